@@ -0,0 +1,180 @@
+#ifndef AckPacer_hpp
+#define AckPacer_hpp
+
+#include <cmath>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "LaserPrinterMove.hpp"
+
+#define ACK_PACER_MIN_SAMPLES 8     // batches fitted before the predictions are checked
+#define ACK_PACER_MIN_CHECKED 8     // predictions checked against the measurement before one is returned
+#define ACK_PACER_MAX_ERROR 0.25    // largest RMS prediction error, relative to the mean processing time
+#define ACK_PACER_RIDGE 1e-3        // regularization, relative to the diagonal of the normal equations
+
+/**
+* \brief What a batch asks of the firmware: total burn duration and head travel.
+*/
+struct BatchWorkload {
+    double burn;    // sum of the burn durations
+    double travel;  // pixels travelled by the head (Manhattan distance)
+};
+
+/**
+* \brief Learns how long the firmware takes to process a batch from its content, to schedule the ack waits.
+*   Model: processing time = a + b * burn + c * travel, fitted online by exponentially weighted least squares
+*   so it follows slow drifts (temperature, mechanical wear) while older samples fade out.
+*   Each new batch is first predicted with the current fit: predictUs() only answers once those predictions
+*   were checked and stayed close to the measurements, see isReliable().
+*/
+class AckPacer {
+public:
+    /**
+    * \param forgetting: weight kept by the previous samples at each new one, between 0 and 1.
+    */
+    AckPacer(double forgetting = 0.98)
+        : m_forgetting(forgetting)
+    {
+        reset();
+    }
+
+    void reset() {
+        memset(m_normal, 0, sizeof(m_normal));
+        memset(m_target, 0, sizeof(m_target));
+        memset(m_weights, 0, sizeof(m_weights));
+        m_samples = 0;
+        m_checked = 0;
+        m_errorSquares = 0;
+        m_measuredSum = 0;
+        m_checkWeight = 0;
+    }
+
+    size_t sampleCount() const {
+        return m_samples;
+    }
+
+    /**
+    * \brief Whether the fit predicted the recent batches well enough to be used: enough samples, and a weighted
+    *   RMS error of the predictions made before each measurement within ACK_PACER_MAX_ERROR of the mean.
+    */
+    bool isReliable() const {
+        if (m_samples < ACK_PACER_MIN_SAMPLES || m_checked < ACK_PACER_MIN_CHECKED || m_measuredSum <= 0)
+            return false;
+        double meanUs = m_measuredSum / m_checkWeight;
+        return std::sqrt(m_errorSquares / m_checkWeight) <= ACK_PACER_MAX_ERROR * meanUs;
+    }
+
+    /**
+    * \brief Workload of a batch of print packets. [lastX] [lastY]: head position before the batch, updated to the position after it.
+    */
+    static BatchWorkload measure(const uint8_t* batch, size_t batchSize, int &lastX, int &lastY) {
+        BatchWorkload workload;
+        workload.burn = 0;
+        workload.travel = 0;
+        LaserPrinterMove move;
+        for (size_t i = 0; i + 4 <= batchSize; i += 4) {
+            move.fromCommand(batch + i);
+            workload.burn += move.duration;
+            workload.travel += abs(static_cast<int>(move.x) - lastX) + abs(static_cast<int>(move.y) - lastY);
+            lastX = move.x;
+            lastY = move.y;
+        }
+        return workload;
+    }
+
+    /**
+    * \return the predicted processing time in microseconds, -1 while the fit is not reliable or predicts no time at all.
+    */
+    double predictUs(const BatchWorkload &workload) const {
+        if (!isReliable())
+            return -1;
+        double prediction = evaluate(workload);
+        return prediction > 0 ? prediction : -1;
+    }
+
+    /**
+    * \brief Add a measurement: the batch of [workload] took [measuredUs] to be processed.
+    */
+    void record(const BatchWorkload &workload, double measuredUs) {
+        if (m_samples >= ACK_PACER_MIN_SAMPLES) {
+            double error = measuredUs - evaluate(workload);
+            m_errorSquares = m_forgetting * m_errorSquares + error * error;
+            m_measuredSum = m_forgetting * m_measuredSum + measuredUs;
+            m_checkWeight = m_forgetting * m_checkWeight + 1;
+            m_checked++;
+        }
+        double x[3];
+        features(workload, x);
+        for (int r = 0; r < 3; r++) {
+            for (int c = 0; c < 3; c++)
+                m_normal[r][c] = m_forgetting * m_normal[r][c] + x[r] * x[c];
+            m_target[r] = m_forgetting * m_target[r] + x[r] * measuredUs;
+        }
+        m_samples++;
+        solve();
+    }
+
+private:
+    //Kilo-units keep the normal equations well conditioned
+    static void features(const BatchWorkload &workload, double* x) {
+        x[0] = 1;
+        x[1] = workload.burn / 1000.0;
+        x[2] = workload.travel / 1000.0;
+    }
+
+    double evaluate(const BatchWorkload &workload) const {
+        double x[3];
+        features(workload, x);
+        return m_weights[0] * x[0] + m_weights[1] * x[1] + m_weights[2] * x[2];
+    }
+
+    /**
+    * \brief Solve (normal + ridge) * weights = target by Gaussian elimination.
+    *   The ridge, proportional to each diagonal term, keeps the system solvable and the weights bounded
+    *   while features move together (e.g. every batch full burn, or a run of identical batches).
+    */
+    void solve() {
+        double m[3][4];
+        for (int r = 0; r < 3; r++) {
+            for (int c = 0; c < 3; c++)
+                m[r][c] = m_normal[r][c] + (r == c ? ACK_PACER_RIDGE * m_normal[r][r] + 1e-9 : 0);
+            m[r][3] = m_target[r];
+        }
+        for (int col = 0; col < 3; col++) {
+            int pivot = col;
+            for (int r = col + 1; r < 3; r++) {
+                if (std::fabs(m[r][col]) > std::fabs(m[pivot][col]))
+                    pivot = r;
+            }
+            if (std::fabs(m[pivot][col]) < 1e-12)
+                return;
+            for (int c = 0; c < 4; c++) {
+                double tmp = m[col][c];
+                m[col][c] = m[pivot][c];
+                m[pivot][c] = tmp;
+            }
+            for (int r = 0; r < 3; r++) {
+                if (r == col)
+                    continue;
+                double factor = m[r][col] / m[col][col];
+                for (int c = col; c < 4; c++)
+                    m[r][c] -= factor * m[col][c];
+            }
+        }
+        for (int r = 0; r < 3; r++)
+            m_weights[r] = m[r][3] / m[r][r];
+    }
+
+    double m_forgetting;
+    double m_normal[3][3];
+    double m_target[3];
+    double m_weights[3];
+    size_t m_samples;
+    size_t m_checked;       // predictions compared to their measurement
+    double m_errorSquares;  // weighted sum of the squared prediction errors
+    double m_measuredSum;   // weighted sum of the measurements the predictions were checked against
+    double m_checkWeight;
+};
+
+#endif // AckPacer_hpp
@@ -0,0 +1,140 @@
+#ifndef BatchQueue_hpp
+#define BatchQueue_hpp
+
+#include <vector>
+#include <mutex>
+#include <condition_variable>
+#include <stdint.h>
+
+/**
+* \brief Bounded single-producer/single-consumer queue of fixed-size move batches.
+*   The producer encodes straight into a free slot while the consumer transmits another one,
+*   with 2 slots this is plain double buffering.
+*   Slots are allocated once, no memory is allocated while streaming.
+*/
+class BatchQueue {
+public:
+    BatchQueue(size_t batchSize, size_t slotCount = 2)
+        : m_batchSize(batchSize)
+        , m_storage(batchSize * slotCount)
+        , m_slotCount(slotCount)
+        , m_readIndex(0)
+        , m_writeIndex(0)
+        , m_count(0)
+        , m_closed(false)
+        , m_aborted(false)
+        , m_batches(m_storage.data())
+    {
+    }
+
+    /**
+    * \brief Queue over [batchCount] batches already encoded in [batches], full and closed: the consumer reads them in place.
+    *   [batches] must outlive the queue.
+    */
+    BatchQueue(const uint8_t* batches, size_t batchSize, size_t batchCount)
+        : m_batchSize(batchSize)
+        , m_slotCount(batchCount)
+        , m_readIndex(0)
+        , m_writeIndex(0)
+        , m_count(batchCount)
+        , m_closed(true)
+        , m_aborted(false)
+        , m_batches(batches)
+    {
+    }
+
+    size_t batchSize() const {
+        return m_batchSize;
+    }
+
+    /**
+    * \brief Producer side: wait for a free slot and return it. NULL if the consumer aborted.
+    */
+    uint8_t* beginWrite() {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        m_notFull.wait(lock, [this]() { return m_count < m_slotCount || m_aborted; });
+        if (m_aborted)
+            return NULL;
+        return &m_storage[m_writeIndex * m_batchSize];
+    }
+
+    /**
+    * \brief Producer side: publish the slot returned by beginWrite().
+    */
+    void commitWrite() {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_writeIndex = (m_writeIndex + 1) % m_slotCount;
+        m_count++;
+        m_notEmpty.notify_one();
+    }
+
+    /**
+    * \brief Producer side: no more batches will be written.
+    */
+    void close() {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_closed = true;
+        m_notEmpty.notify_all();
+    }
+
+    /**
+    * \brief Consumer side: wait for the next batch. NULL once the queue is closed and drained, or aborted.
+    */
+    const uint8_t* beginRead() {
+        return peek(0);
+    }
+
+    /**
+    * \brief Consumer side: wait for the batch [offset] positions after the oldest unreleased one.
+    *   Lets the consumer keep several batches in flight while they stay stored until released.
+    *   NULL once the queue is closed without that batch, or aborted.
+    */
+    const uint8_t* peek(size_t offset) {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        m_notEmpty.wait(lock, [this, offset]() { return m_count > offset || m_closed || m_aborted; });
+        if (m_aborted || m_count <= offset || offset >= m_slotCount)
+            return NULL;
+        return m_batches + ((m_readIndex + offset) % m_slotCount) * m_batchSize;
+    }
+
+    /**
+    * \brief Consumer side: release the oldest slot (returned by beginRead() or peek(0)) so it can be refilled.
+    */
+    void commitRead() {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_readIndex = (m_readIndex + 1) % m_slotCount;
+        m_count--;
+        m_notFull.notify_one();
+    }
+
+    /**
+    * \brief Either side: stop the transfer, wakes up any blocked call.
+    */
+    void abort() {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_aborted = true;
+        m_notFull.notify_all();
+        m_notEmpty.notify_all();
+    }
+
+    bool isAborted() {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        return m_aborted;
+    }
+
+private:
+    size_t m_batchSize;
+    std::vector<uint8_t> m_storage;
+    size_t m_slotCount;
+    size_t m_readIndex;
+    size_t m_writeIndex;
+    size_t m_count;
+    bool m_closed;
+    bool m_aborted;
+    const uint8_t* m_batches;   // m_storage, or the batches given to the constructor
+    std::mutex m_mutex;
+    std::condition_variable m_notFull;
+    std::condition_variable m_notEmpty;
+};
+
+#endif // BatchQueue_hpp
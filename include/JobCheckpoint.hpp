@@ -0,0 +1,211 @@
+#ifndef JobCheckpoint_hpp
+#define JobCheckpoint_hpp
+
+#include <string>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <stdint.h>
+#include <stdio.h>
+
+#ifdef _WIN32
+    #include <io.h>
+#else
+    #include <fcntl.h>
+    #include <unistd.h>
+#endif
+
+#define JOB_CHECKPOINT_VERSION 1
+
+/**
+* \brief Progress of a print job, saved as batches are acknowledged (see JobCheckpointWriter) so an interrupted job can be resumed.
+*   The checksum covers the acknowledged batches: on resume the job is encoded again and
+*   must produce the same first batches, otherwise it is not the job that was interrupted.
+*/
+struct JobCheckpoint {
+    unsigned int originX;
+    unsigned int originY;
+    int width;
+    int height;
+    bool fan;
+    size_t batches;     // acknowledged batches
+    uint32_t checksum;  // FNV-1a of the acknowledged batches
+
+    JobCheckpoint()
+        : originX(0)
+        , originY(0)
+        , width(0)
+        , height(0)
+        , fan(false)
+        , batches(0)
+        , checksum(2166136261u)
+    {
+    }
+
+    /**
+    * \brief Add an acknowledged batch.
+    */
+    void add(const uint8_t* batch, size_t batchSize) {
+        checksum = hash(checksum, batch, batchSize);
+        batches++;
+    }
+
+    static uint32_t hash(uint32_t seed, const uint8_t* data, size_t length) {
+        for (size_t i = 0; i < length; i++) {
+            seed ^= data[i];
+            seed *= 16777619u;
+        }
+        return seed;
+    }
+
+    bool sameJob(const JobCheckpoint &other) const {
+        return width == other.width && height == other.height && fan == other.fan;
+    }
+
+    /**
+    * \brief Write the checkpoint to [path] through a temporary file, so a crash never leaves a truncated one.
+    *   The file is flushed to the disk before the rename, and the directory after it, so a power loss does not either.
+    */
+    bool save(const std::string &path) const {
+        std::string tmpPath = path + ".tmp";
+        FILE* file = fopen(tmpPath.c_str(), "w");
+        if (file == NULL)
+            return false;
+        int written = fprintf(file, "LaserPrinterCheckpoint %d %u %u %d %d %d %lu %08x\n", JOB_CHECKPOINT_VERSION,
+            originX, originY, width, height, fan ? 1 : 0, static_cast<unsigned long>(batches), checksum);
+        bool synced = fflush(file) == 0 && syncFile(file);
+        if (fclose(file) != 0 || written <= 0 || !synced)
+            return false;
+        if (rename(tmpPath.c_str(), path.c_str()) != 0)
+            return false;
+        syncDirectory(path);
+        return true;
+    }
+
+    /**
+    * \return false if [path] does not hold a valid checkpoint.
+    */
+    bool load(const std::string &path) {
+        FILE* file = fopen(path.c_str(), "r");
+        if (file == NULL)
+            return false;
+        int version = 0;
+        int fanValue = 0;
+        unsigned long batchCount = 0;
+        int fields = fscanf(file, "LaserPrinterCheckpoint %d %u %u %d %d %d %lu %x", &version,
+            &originX, &originY, &width, &height, &fanValue, &batchCount, &checksum);
+        fclose(file);
+        fan = fanValue != 0;
+        batches = batchCount;
+        return fields == 8 && version == JOB_CHECKPOINT_VERSION;
+    }
+
+    static void remove(const std::string &path) {
+        ::remove(path.c_str());
+    }
+
+private:
+    static bool syncFile(FILE* file) {
+#ifdef _WIN32
+        return _commit(_fileno(file)) == 0;
+#else
+        return fsync(fileno(file)) == 0;
+#endif
+    }
+
+    /**
+    * \brief Make the rename of a file in the directory of [path] durable. Nothing to do on Windows.
+    */
+    static void syncDirectory(const std::string &path) {
+#ifndef _WIN32
+        size_t slash = path.rfind('/');
+        std::string directory = slash == std::string::npos ? "." : (slash == 0 ? "/" : path.substr(0, slash));
+        int fd = open(directory.c_str(), O_RDONLY);
+        if (fd >= 0) {
+            fsync(fd);
+            close(fd);
+        }
+#endif
+    }
+};
+
+/**
+* \brief Saves the checkpoints of a running job from its own thread, so the streaming thread never waits for the disk.
+*   Only the latest checkpoint posted is written: the file trails the printer by the batches acknowledged during one save.
+*/
+class JobCheckpointWriter {
+public:
+    JobCheckpointWriter()
+        : m_pending(false)
+        , m_stop(false)
+    {
+    }
+
+    ~JobCheckpointWriter() {
+        finish();
+    }
+
+    /**
+    * \brief Start saving the checkpoints posted to [path].
+    */
+    void start(const std::string &path) {
+        finish();
+        m_path = path;
+        m_pending = false;
+        m_stop = false;
+        m_thread = std::thread([this]() { run(); });
+    }
+
+    bool isRunning() const {
+        return m_thread.joinable();
+    }
+
+    /**
+    * \brief Replace the checkpoint waiting to be saved, if any, by [checkpoint]. Does not wait for the disk.
+    */
+    void post(const JobCheckpoint &checkpoint) {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_latest = checkpoint;
+        m_pending = true;
+        m_wakeUp.notify_one();
+    }
+
+    /**
+    * \brief Save the last checkpoint posted, then stop.
+    */
+    void finish() {
+        if (!m_thread.joinable())
+            return;
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_stop = true;
+            m_wakeUp.notify_one();
+        }
+        m_thread.join();
+    }
+
+private:
+    void run() {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        while (true) {
+            m_wakeUp.wait(lock, [this]() { return m_pending || m_stop; });
+            if (!m_pending)
+                return;
+            JobCheckpoint checkpoint = m_latest;
+            m_pending = false;
+            lock.unlock();
+            checkpoint.save(m_path);
+            lock.lock();
+        }
+    }
+
+    std::string m_path;
+    JobCheckpoint m_latest;
+    bool m_pending;
+    bool m_stop;
+    std::mutex m_mutex;
+    std::condition_variable m_wakeUp;
+    std::thread m_thread;
+};
+
+#endif // JobCheckpoint_hpp
@@ -0,0 +1,119 @@
+#ifndef LaserPrintJob_hpp
+#define LaserPrintJob_hpp
+
+#include <string>
+#include <memory>
+#include <future>
+#include <atomic>
+#include <mutex>
+#include <chrono>
+
+/**
+* \brief State shared between a job submitted to LaserPrinter and its handles.
+*/
+struct LaserPrintJobState {
+    std::atomic<bool> cancelled;
+    std::atomic<size_t> batchesSent;
+    std::atomic<size_t> movesSent;
+    std::promise<int> promise;
+    std::shared_future<int> result;
+    std::mutex mutex;
+    std::string errorMessage;
+
+    LaserPrintJobState()
+        : cancelled(false)
+        , batchesSent(0)
+        , movesSent(0)
+        , result(promise.get_future().share())
+    {
+    }
+
+    /**
+    * \brief Publish the result of the job, wakes up every wait().
+    */
+    void finish(int error, const std::string &message) {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            errorMessage = message;
+        }
+        promise.set_value(error);
+    }
+};
+
+/**
+* \brief Handle on a print job running on the LaserPrinter worker thread (see LaserPrinter::submitImage and submitShape).
+*   Copyable, every copy refers to the same job. Every method can be called from any thread.
+*/
+class LaserPrintJob {
+public:
+    LaserPrintJob()
+    {
+    }
+
+    explicit LaserPrintJob(std::shared_ptr<LaserPrintJobState> state)
+        : m_state(state)
+    {
+    }
+
+    bool isValid() const {
+        return m_state != NULL;
+    }
+
+    /**
+    * \brief Block until the job is done.
+    * \return 0 on success or a LaserPrinterError
+    */
+    int wait() const {
+        return m_state->result.get();
+    }
+
+    /**
+    * \return false if the job was not done after [timeoutMs]
+    */
+    bool waitFor(int timeoutMs) const {
+        return m_state->result.wait_for(std::chrono::milliseconds(timeoutMs)) == std::future_status::ready;
+    }
+
+    bool isDone() const {
+        return waitFor(0);
+    }
+
+    std::shared_future<int> result() const {
+        return m_state->result;
+    }
+
+    /**
+    * \brief Reason of the failure once done, empty on success.
+    */
+    std::string errorMessage() const {
+        std::lock_guard<std::mutex> lock(m_state->mutex);
+        return m_state->errorMessage;
+    }
+
+    /**
+    * \brief Batches written to the printer so far, resent batches are not counted twice.
+    */
+    size_t batchesSent() const {
+        return m_state->batchesSent;
+    }
+
+    /**
+    * \brief Moves written to the printer so far, the empty packets padding the last batch excluded.
+    */
+    size_t movesSent() const {
+        return m_state->movesSent;
+    }
+
+    /**
+    * \brief Drop the job if it did not start yet, otherwise stop it like LaserPrinter::abort().
+    *   The job then completes with LASER_PRINTER_ABORTED.
+    */
+    void cancel() {
+        m_state->cancelled = true;
+    }
+
+private:
+    std::shared_ptr<LaserPrintJobState> m_state;
+};
+
+#endif // LaserPrintJob_hpp
@@ -2,378 +2,1221 @@
 #define LaserPrinter_hpp
 
 #include <string>
+#include <vector>
 #include <algorithm>
 #include <thread>
 #include <chrono>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <deque>
+#include <memory>
+#include <cmath>
+#include <stdint.h>
+#include <limits.h>
+#include <stdio.h>
+#include <string.h>
 
-#include "SerialPort.hpp"
+#include "LaserPrinterMove.hpp"
+#include "MoveBuffer.hpp"
+#include "PrintProgram.hpp"
+#include "PrintProgramFile.hpp"
+#include "LaserTransport.hpp"
+#include "BatchQueue.hpp"
+#include "AckPacer.hpp"
+#include "JobCheckpoint.hpp"
+#include "LaserPrintJob.hpp"
 
-#ifdef WITH_OPENCV
-    #include "opencv2/opencv.hpp"
-#endif
+#define LASER_PRINTER_DEFAULT_ACK_TIMEOUT_MS 30000
+#define LASER_PRINTER_PACING_MARGIN 0.2 // part of the predicted batch processing time not slept
+#define LASER_PRINTER_ACK_DEADLINE_FACTOR 4 // adaptive ack deadline in predicted batch processing times
+#define LASER_PRINTER_MIN_ACK_DEADLINE_MS 1000
+#define LASER_PRINTER_ABORT_TIMEOUT_MS 1000
+#define LASER_PRINTER_RESYNC_CHUNK 32       // bytes sent at a time while looking for the end of a partial batch
+#define LASER_PRINTER_RESYNC_STEP_MS 250    // wait for the "B1" of an empty batch during a resync
+#define LASER_PRINTER_CONTROL_POLL_MS 10 // how often a paused job checks for resume or abort
 
-#define LASER_PRINTER_RESOLUTION_WIDTH 1024
-#define LASER_PRINTER_RESOLUTION_HEIGHT 1024
-#define LASER_PRINTER_MOVE_BUFFER_LENGHT 256
+enum LaserPrinterError {
+    LASER_PRINTER_OK = 0,
+    LASER_PRINTER_NOT_READY = -1,       // not connected, or already printing
+    LASER_PRINTER_OUT_OF_AREA = -2,     // the job does not fit in the printing area
+    LASER_PRINTER_ACK_TIMEOUT = -3,     // a batch was not acknowledged, recovery included
+    LASER_PRINTER_END_TIMEOUT = -4,     // "F22" did not follow "$33"
+    LASER_PRINTER_LINK_ERROR = -5,      // the transport refused a write
+    LASER_PRINTER_CHECKPOINT_ERROR = -6,// no checkpoint to resume, or it belongs to another job
+    LASER_PRINTER_ABORTED = -7,         // stopped by abort() or cancelled
+    LASER_PRINTER_PLANNING_ERROR = -8   // the job could not be prepared (e.g. unreadable SVG file)
+};
 
+/**
+* \brief Recovery policy when a batch is not acknowledged in time.
+*/
+enum LaserPrinterRecovery {
+    LASER_PRINTER_RECOVERY_ABORT,       // end the job and report LASER_PRINTER_ACK_TIMEOUT
+    LASER_PRINTER_RECOVERY_RESEND,      // send the unacknowledged batches again
+    LASER_PRINTER_RECOVERY_RESYNC       // complete a partial batch, restart the print session, then resend
+};
+
+/**
+* \brief Prepares the segments of a job off the caller's thread (e.g. parses a file), sets the size of the job.
+*   An empty result fails the job. See LaserPrinter::submitShape() and LaserPrinterFarm::submitShape().
+*/
+typedef std::function<std::vector<LaserPrinterSegment>(int &width, int &height)> LaserShapePlanner;
 
 /**
-* Print packet: {(A)0x00, (B)0x00, (C)0x00, (D)0x00}
-*   A: 8 low signicative bits for the X position
-*   B:
-*    - 4 first bits: high signicative bits for the X position
-*    - 4 last  bits: high signicative bits for the Y position
-*   C: 8 low signicative bits for the Y position
-*   D: laser burn duration at the given position
-*   Print packets should be sent in batches of 256 packets.
-*   If less than 256 packets need to be sent, fill with packets filled with 0x00.
-*
-*  x: between 0 and 1023
-*  y: between 0 and 1023
-*  duration: between 0 and 255
+* \brief Where a copy of a job starts, see LaserPrinter::printStepAndRepeat().
 */
-struct LaserPrinterMove {
+struct LaserPrintOrigin {
     unsigned int x;
     unsigned int y;
-    uint8_t duration;
 
-    LaserPrinterMove() {
-        x = 0;
-        y = 0;
-        duration = 0;
+    LaserPrintOrigin(unsigned int _x = 0, unsigned int _y = 0)
+        : x(_x)
+        , y(_y)
+    {
     }
+};
 
-    LaserPrinterMove(unsigned int x, unsigned y, uint8_t duration) {
-        this->x = x;
-        this->y = y;
-        this->duration = duration;
-    }
+/**
+* \brief How the firmware acknowledges a "$" command.
+*   reply: token the firmware answers with, "" for any answer, NULL if it does not answer.
+*   deadlineMs: longest time the command takes, -1 for the batch ack timeout.
+*/
+struct LaserPrinterCommandSpec {
+    const char* code;
+    const char* reply;
+    int deadlineMs;
+};
 
-    void fromCommand(uint8_t* command) {
-        x = command[0] + 16 * (command[1] & 0xF0);
-        y = command[2] + 255 * (command[1] & 0x0F);
-        duration = command[3];
-    }
 
-    void toCommand(uint8_t* command) {
-        command[0] = x & 0x0FF;
-        command[1] = (x & 0xF00) / 16 + (y & 0xF00) / 255;
-        command[2] = y & 0x0FF;
-        command[3] = duration;
-    }
+/**
+* \brief A job waiting for the worker thread.
+*/
+struct LaserPrinterPendingJob {
+    std::shared_ptr<LaserPrintJobState> state;
+    std::function<int()> run;
 };
 
-struct LaserPrinterSegment {
-    LaserPrinterSegment() {}
-    LaserPrinterSegment(unsigned int _startX
-        , unsigned int _startY
-        , unsigned int _endX
-        , unsigned int _endY
-        , uint8_t _duration)
-    {
-        startX = _startX;
-        startY = _startY;
-        endX = _endX;
-        endY = _endY;
-        duration = _duration;
-    }
-    unsigned int startX = 0;
-    unsigned int startY = 0;
-    unsigned int endX = 0;
-    unsigned int endY = 0;
-    uint8_t duration;
-
-    void reverse() {
-        unsigned int _startX = startX;
-        unsigned int _startY = startY;
-        startX = endX;
-        startY = endY;
-        endX = _startX;
-        endY = _startY;
-    }
-
-    std::vector<LaserPrinterMove> getInterpolation() {
-        std::vector<LaserPrinterMove> out;
-        float distanceX = (float)endX - (float)startX;
-        float distanceY = (float)endY - (float)startY;
-        float distance = std::sqrtf(std::powf(distanceX, 2.f) + std::powf(distanceY, 2.f));
-        out.push_back(LaserPrinterMove(startX, startY, duration));
-        if (distance > 1) {
-            for (float i = 1; i < distance; i+=1) {
-                float step = i / distance;
-                out.push_back(LaserPrinterMove(lerp(startX, endX, step), lerp(startY, endY, step), duration));
-            }
-        }
-        out.push_back(LaserPrinterMove(endX, endY, duration));
-        return out;
-    }
-private:
-    float lerp(float a, float b, float f)  {
-        return a + f * (b - a);
-    }
+/**
+* \brief What the link and the firmware sustained during LaserPrinter::runLinkTest().
+*/
+struct LaserLinkReport {
+    int batches;            // batches acknowledged
+    int failures;           // acknowledgements not received in time: recovered by the recovery policy, or the one that ended the test
+    double seconds;
+    double batchesPerSecond;
+    double movesPerSecond;
+    double p50AckMs;        // time from the end of a batch write to its "B1"
+    double p99AckMs;
+    double maxAckMs;
+};
+
+/**
+* \brief A batch sent and not acknowledged yet.
+*/
+struct BatchFlight {
+    std::chrono::steady_clock::time_point sent;     // end of the write
+    BatchWorkload workload;
+};
+
+/**
+* \brief What LaserPrinter::streamBatches() measures for a link test instead of training the pacer.
+*/
+struct LaserLinkSamples {
+    int ackTimeoutMs;                       // replaces the ack deadline
+    int lostAcks;
+    std::vector<double> ackLatenciesMs;     // one per acknowledged batch, from the end of its write
 };
 
 class LaserPrinter {
 public:
+    /**
+    * \param serialPort: port name, "auto" to probe every serial port, "" to connect later.
+    * \param simulating: print on a SimulatorTransport instead of a real printer, [serialPort] is then ignored.
+    */
     LaserPrinter(std::string serialPort, bool simulating=false)
-        : m_serialPort("")
-        , m_serial(NULL)
+        : m_transport(NULL)
         , m_connected(false)
         , m_printOriginX(0)
         , m_printOriginY(0)
         , m_printing(false)
-        , m_simulating(simulating)
+        , m_ackTimeoutMs(LASER_PRINTER_DEFAULT_ACK_TIMEOUT_MS)
+        , m_batchWindow(1)
+        , m_adaptivePacing(true)
+        , m_adaptiveDeadline(false)
+        , m_recovery(LASER_PRINTER_RECOVERY_ABORT)
+        , m_maxRetries(2)
+        , m_jobOriginX(0)
+        , m_jobOriginY(0)
+        , m_jobFan(false)
+        , m_endPending(false)
+        , m_lastError(LASER_PRINTER_OK)
+        , m_pauseRequested(false)
+        , m_abortRequested(false)
+        , m_job(NULL)
+        , m_stopWorker(false)
+        , m_activeJobs(0)
     {
-        if (serialPort == "auto") {
+        if (simulating) {
+            setSimulation(true);
+        }
+        else if (serialPort == "auto") {
             autoConnect();
         }
         else if (serialPort != "") {
             connect(serialPort);
         }
-        setSimulation(m_simulating);
     }
 
+    /**
+    * \brief Drive the printer through any transport (PTY, loopback, capture file, simulator...). Takes ownership of [transport].
+    */
+    LaserPrinter(LaserTransport* transport)
+        : m_transport(NULL)
+        , m_connected(false)
+        , m_printOriginX(0)
+        , m_printOriginY(0)
+        , m_printing(false)
+        , m_ackTimeoutMs(LASER_PRINTER_DEFAULT_ACK_TIMEOUT_MS)
+        , m_batchWindow(1)
+        , m_adaptivePacing(true)
+        , m_adaptiveDeadline(false)
+        , m_recovery(LASER_PRINTER_RECOVERY_ABORT)
+        , m_maxRetries(2)
+        , m_jobOriginX(0)
+        , m_jobOriginY(0)
+        , m_jobFan(false)
+        , m_endPending(false)
+        , m_lastError(LASER_PRINTER_OK)
+        , m_pauseRequested(false)
+        , m_abortRequested(false)
+        , m_job(NULL)
+        , m_stopWorker(false)
+        , m_activeJobs(0)
+    {
+        open(transport);
+    }
+
+    /**
+    * \brief Submitted jobs that did not complete are cancelled.
+    */
     ~LaserPrinter() {
-        if (m_serial != NULL) {
-            if (m_connected) {
-                m_serial->write("$42");
-                std::this_thread::sleep_for(std::chrono::milliseconds(10));
-            }
-            delete m_serial;
-            m_serial = NULL;
-        }
+        stopWorker();
+        close();
     }
 
     void setSimulation(bool simulate) {
-        m_simulating = simulate;
-#ifdef WITH_OPENCV
-        if(m_simulating)
-            m_previewImage = cv::Mat::zeros(cv::Size(LASER_PRINTER_RESOLUTION_WIDTH, LASER_PRINTER_RESOLUTION_HEIGHT), CV_8UC1);
-#endif
+        std::lock_guard<std::recursive_mutex> lock(m_mutex);
+        if (simulate)
+            open(new SimulatorTransport());
+        else
+            close();
     }
 
     bool connect(std::string serialPort) {
-        if (m_simulating) {
-            m_serialPort = "simulating";
-            m_connected = true;
-            return m_connected;
-        }
-        m_serial = new SerialPort(serialPort);
-        m_serial->write("$40");//Home position
-        std::this_thread::sleep_for(std::chrono::milliseconds(3000));
-        std::string msg = m_serial->read();
-        if (msg.find("connect") == std::string::npos) {
-            delete m_serial;
-            m_serial = NULL;
-            m_connected = false;
+        return open(new SerialTransport(serialPort));
+    }
+
+    /**
+    * \brief Handshake with the printer on [transport]. Takes ownership of [transport], it is deleted if the printer does not answer.
+    */
+    bool open(LaserTransport* transport) {
+        std::lock_guard<std::recursive_mutex> lock(m_mutex);
+        close();
+        if (transport->isOpen()) {
+            m_transport = transport;
+            m_connected = sendCommand("$40");//Home position
         }
-        else {
-            m_serialPort = serialPort;
-            m_connected = true;
+        if (!m_connected) {
+            m_transport = NULL;
+            delete transport;
         }
+        setPortName();
         return m_connected;
     }
 
-    bool autoConnect() {
-        if (m_simulating) {
-            m_serialPort = "simulating";
-            m_connected = true;
-            return m_connected;
+    void close() {
+        std::lock_guard<std::recursive_mutex> lock(m_mutex);
+        if (m_transport != NULL) {
+            if (m_connected) {
+                m_transport->write("$42");
+                std::this_thread::sleep_for(std::chrono::milliseconds(10));
+            }
+            delete m_transport;
+            m_transport = NULL;
         }
+        m_connected = false;
+        setPortName();
+    }
+
+    /**
+    * \brief Probe every serial port at the same time, the first one to complete the handshake is kept.
+    * \param timeoutMs: how long each port has to answer "connect"
+    */
+    bool autoConnect(int timeoutMs = 3000) {
+        std::lock_guard<std::recursive_mutex> lock(m_mutex);
+        close();
         std::vector<std::string> serialList = SerialPort::getSerialPortsList();
-        for (int i = 1; i < serialList.size(); i++) {
-            if (connect(serialList.at(i)))
-                return m_connected;
+        std::mutex mutex;
+        std::condition_variable probeDone;
+        std::atomic<bool> found(false);
+        LaserTransport* winner = NULL;
+        size_t finished = 0;
+        std::vector<std::thread> probes;
+        for (size_t i = 0; i < serialList.size(); i++) {
+            std::string port = serialList.at(i);
+            probes.push_back(std::thread([&, port]() {
+                LaserTransport* transport = new SerialTransport(port);
+                bool answered = transport->isOpen()
+                    && transport->write("$40")
+                    && waitForToken(transport, "connect", timeoutMs, &found);
+                std::lock_guard<std::mutex> lock(mutex);
+                if (answered && winner == NULL) {
+                    winner = transport;
+                    found = true;
+                }
+                else {
+                    delete transport;
+                }
+                finished++;
+                probeDone.notify_all();
+            }));
+        }
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            probeDone.wait(lock, [&]() { return winner != NULL || finished == probes.size(); });
         }
+        //Losing probes notice [found] within one read slice
+        for (size_t i = 0; i < probes.size(); i++)
+            probes.at(i).join();
+        m_transport = winner;
+        m_connected = winner != NULL;
+        setPortName();
+        return m_connected;
+    }
+
+    /**
+    * \brief Name of the link to the printer, empty if not connected.
+    */
+    std::string getPortName() {
+        std::lock_guard<std::mutex> lock(m_stateMutex);
+        return m_portName;
     }
 
     bool isConnected() {
         return m_connected;
     }
 
+    /*
+    * \param timeoutMs: maximum time to wait for the printer to acknowledge a batch of moves
+    */
+    void setAckTimeout(int timeoutMs) {
+        m_ackTimeoutMs = timeoutMs;
+    }
+
+    /*
+    * \param batches: number of batches sent ahead of their acknowledgement, the firmware must be able to buffer them.
+    *   1 waits for each "B1" before sending the next batch.
+    */
+    void setBatchWindow(int batches) {
+        m_batchWindow = (std::max)(1, batches);
+    }
+
+    int getBatchWindow() {
+        return m_batchWindow;
+    }
+
+    /*
+    * \brief What to do when a batch is not acknowledged in time.
+    *   Both recoveries first wait a little longer for late "B1": the batches they answer are done and not sent again.
+    *   LASER_PRINTER_RECOVERY_RESEND then sends the other batches in flight again. It is only harmless when a batch
+    *   was lost whole: if only its "B1" was, or part of its bytes, the batch is burnt twice or the session is out of step.
+    *   LASER_PRINTER_RECOVERY_RESYNC first brings the printer back to a batch boundary and restarts the print session,
+    *   see resyncJob(). The moves of a batch received in part may still be burnt twice.
+    * \param maxRetries: recovery attempts per batch before the job is aborted.
+    *   Applies from the next job, it does not wait for the running one.
+    */
+    void setRecoveryPolicy(LaserPrinterRecovery recovery, int maxRetries = 2) {
+        m_recovery = recovery;
+        m_maxRetries = maxRetries;
+    }
+
+    /**
+    * \brief Hold the running job before its next batch, the batches already sent are still printed.
+    *   When no job runs, the next one is held before its first batch. The request ends with the job it applied to.
+    *   Like resume() and abort(), only sets a lock-free flag: safe from another thread or a signal handler.
+    */
+    void pause() {
+        m_pauseRequested = true;
+    }
+
+    void resume() {
+        m_pauseRequested = false;
+    }
+
+    bool isPaused() {
+        return m_pauseRequested;
+    }
+
+    /**
+    * \brief Stop the running job, blocking or submitted, within one batch: no more batch is sent, the ack wait is given up,
+    *   "$33" ends the print session and the print call returns LASER_PRINTER_ABORTED, the port is then free for another job.
+    *   Between two submitted jobs, the next one is stopped before it starts. Ignored when no job is running nor submitted.
+    */
+    void abort() {
+        if (m_printing || m_activeJobs > 0)
+            m_abortRequested = true;
+    }
+
+    /**
+    * \brief Save the progress of print jobs to [path] as batches are acknowledged, "" to disable it.
+    *   The saves run on their own thread and are synced to the disk: the file may trail the printer by the batches
+    *   acknowledged during one save, a resume then prints those again.
+    *   The file is removed when a job completes and kept when it fails, to continue it with resumeImage() or resumeShape().
+    */
+    void setCheckpointFile(const std::string &path) {
+        std::lock_guard<std::mutex> lock(m_stateMutex);
+        m_checkpointPath = path;
+    }
+
+    /**
+    * \brief Result of the last print: LASER_PRINTER_OK or a LaserPrinterError.
+    */
+    int getLastError() {
+        std::lock_guard<std::mutex> lock(m_stateMutex);
+        return m_lastError;
+    }
+
+    /**
+    * \brief Reason of the last failure, empty on success.
+    */
+    std::string getLastErrorMessage() {
+        std::lock_guard<std::mutex> lock(m_stateMutex);
+        return m_lastErrorMessage;
+    }
+
+    /*
+    * \param enabled: schedule the ack waits from the predicted processing time of each batch (on by default).
+    */
+    void setAdaptivePacing(bool enabled) {
+        m_adaptivePacing = enabled;
+    }
+
+    /*
+    * \param enabled: give up on an acknowledgement after LASER_PRINTER_ACK_DEADLINE_FACTOR times the predicted
+    *   processing time of its batch, when the pacer is reliable, instead of the full ack timeout (off by default).
+    *   A lost batch is then noticed sooner, at the risk of giving up on a batch slower than predicted.
+    */
+    void setAdaptiveAckDeadline(bool enabled) {
+        m_adaptiveDeadline = enabled;
+    }
+
+    /**
+    * \brief Model of the firmware batch processing time, learnt from the acknowledgements.
+    *   A copy: the running job keeps updating the model.
+    */
+    AckPacer getAckPacer() {
+        std::lock_guard<std::mutex> lock(m_stateMutex);
+        return m_pacer;
+    }
+
+    /**
+    * \brief Find how many batches the firmware buffers and use it as batch window.
+    *   Runs an empty job at the print origin: rounds of 2, 3... [maxDepth] empty batches are sent back to back,
+    *   the depth is the largest round fully acknowledged within [timeoutMs] per batch.
+    *   The probe overflows the firmware receive buffer on purpose. The emulator drops the extra batch whole, a real
+    *   firmware may keep part of it or answer late: the session is then out of step and the probe fails.
+    *   It is refused when a real printer may be connected (see LaserTransport::isHardware()) unless [allowOnHardware] is set.
+    *   Prefer setBatchWindow() with the depth documented for the firmware.
+    * \return the detected depth, -1 if not connected, printing, refused or if the session did not end cleanly.
+    */
+    int probeBatchWindow(int maxDepth = 8, int timeoutMs = 1000, bool allowOnHardware = false) {
+        std::lock_guard<std::recursive_mutex> lock(m_mutex);
+        if (!m_connected || m_printing)
+            return -1;
+        if (!allowOnHardware && m_transport->isHardware()) {
+            setError(LASER_PRINTER_NOT_READY, "probing the batch window overflows the firmware buffer, not done on a real printer");
+            return -1;
+        }
+        m_printing = true;
+        uint8_t emptyBatch[LASER_PRINTER_MOVE_BUFFER_LENGHT * 4];
+        memset(emptyBatch, 0, sizeof(emptyBatch));
+        startJob(m_printOriginX, m_printOriginY, false);
+        int depth = 1;
+        for (int round = 2; round <= maxDepth; round++) {
+            for (int i = 0; i < round; i++)
+                m_transport->write(emptyBatch, sizeof(emptyBatch));
+            int acknowledged = 0;
+            while (acknowledged < round && waitForResponse("B1", timeoutMs))
+                acknowledged++;
+            if (acknowledged < round) {
+                //Late answers of the round must not be taken for the end of the job
+                while (waitForResponse("B1", timeoutMs))
+                    ;
+                break;
+            }
+            depth = round;
+        }
+        int result = endJob();
+        m_printing = false;
+        if (result != LASER_PRINTER_OK)
+            return -1;
+        setBatchWindow(depth);
+        return depth;
+    }
+
+    /**
+    * \brief Measure what the link and the firmware sustain: stream [batchCount] batches of zero-duration moves
+    *   at the print origin like a job (batch window, pacing and recovery policy), and time their acknowledgements.
+    *   The laser stays off and the head still. A flaky adapter or hub shows as a high p99/max or failures.
+    *   The empty batches are not learnt by the pacer nor checkpointed. getLastError() tells how the test ended.
+    * \param timeoutMs: time each batch has to be acknowledged, in place of the ack timeout.
+    */
+    LaserLinkReport runLinkTest(int batchCount = 100, int timeoutMs = 1000) {
+        std::lock_guard<std::recursive_mutex> lock(m_mutex);
+        LaserLinkReport report;
+        memset(&report, 0, sizeof(report));
+        if (!m_connected || m_printing) {
+            report.failures = 1;
+            setError(LASER_PRINTER_NOT_READY, m_connected ? "a job is already printing" : "not connected");
+            return report;
+        }
+        m_printing = true;
+        std::vector<uint8_t> emptyBatches((std::max)(batchCount, 0) * LASER_PRINTER_MOVE_BUFFER_LENGHT * 4, 0);
+        BatchQueue queue(emptyBatches.data(), LASER_PRINTER_MOVE_BUFFER_LENGHT * 4, (std::max)(batchCount, 0));
+        LaserLinkSamples samples;
+        samples.ackTimeoutMs = timeoutMs;
+        samples.lostAcks = 0;
+        samples.ackLatenciesMs.reserve(emptyBatches.size() / queue.batchSize());
+        m_checkpoint = JobCheckpoint();
+        startJob(m_printOriginX, m_printOriginY, false);
+        std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+        int result = streamBatches(queue, m_batchWindow, &samples);
+        report.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        result = finishJob(result);
+        m_printing = false;
+        endControlRequests();
+
+        std::vector<double> &latenciesMs = samples.ackLatenciesMs;
+        report.batches = static_cast<int>(latenciesMs.size());
+        report.failures = samples.lostAcks;
+        if (report.seconds > 0) {
+            report.batchesPerSecond = report.batches / report.seconds;
+            report.movesPerSecond = report.batchesPerSecond * LASER_PRINTER_MOVE_BUFFER_LENGHT;
+        }
+        if (!latenciesMs.empty()) {
+            std::sort(latenciesMs.begin(), latenciesMs.end());
+            report.p50AckMs = latenciesMs[(latenciesMs.size() - 1) / 2];
+            report.p99AckMs = latenciesMs[(latenciesMs.size() * 99 + 99) / 100 - 1];
+            report.maxAckMs = latenciesMs.back();
+        }
+        if (result == LASER_PRINTER_OK)
+            setError(LASER_PRINTER_OK, "");
+        return report;
+    }
+
     void setPrintOrigin(unsigned int x, unsigned int y) {
         m_printOriginX = (std::min)(x, static_cast<unsigned int>(LASER_PRINTER_RESOLUTION_WIDTH));
         m_printOriginY = (std::min)(y, static_cast<unsigned int>(LASER_PRINTER_RESOLUTION_HEIGHT));
     }
 
+    /**
+    * \brief Like the area previews, ignored while the link is busy with a job: it does not wait for the job.
+    */
     void resetOrigin() {
-        if (!m_connected || m_printing || m_simulating)
+        std::unique_lock<std::recursive_mutex> lock(m_mutex, std::try_to_lock);
+        if (!lock.owns_lock() || !m_connected || m_printing)
             return;
-        m_serial->write("$42");
-        std::this_thread::sleep_for(std::chrono::milliseconds(3000));
-        m_serial->read();
+        sendCommand("$42");
     }
 
     void startAreaPreview(int width, int height) {
-        if (!m_connected || m_printing || m_simulating)
+        std::unique_lock<std::recursive_mutex> lock(m_mutex, std::try_to_lock);
+        if (!lock.owns_lock() || !m_connected || m_printing)
             return;
-        m_serial->write("$20 P" + std::to_string(m_printOriginX) + " " + std::to_string(m_printOriginY) + " " + std::to_string(width) + " " + std::to_string(height));
-        std::this_thread::sleep_for(std::chrono::milliseconds(2000));
-        m_serial->read();
+        sendCommand("$20 P" + std::to_string(m_printOriginX) + " " + std::to_string(m_printOriginY) + " " + std::to_string(width) + " " + std::to_string(height));
     }
 
     void stopAreaPreview() {
-        if (!m_connected || m_printing || m_simulating)
+        std::unique_lock<std::recursive_mutex> lock(m_mutex, std::try_to_lock);
+        if (!lock.owns_lock() || !m_connected || m_printing)
             return;
-        m_serial->write("$25 P" + std::to_string(m_printOriginX) + " " + std::to_string(m_printOriginY));
-        std::this_thread::sleep_for(std::chrono::milliseconds(2000));
-        m_serial->read();
+        sendCommand("$25 P" + std::to_string(m_printOriginX) + " " + std::to_string(m_printOriginY));
     }
 
+    /*
+    * \brief Print [image] and return once done. Waits for the job running on another thread, if any.
+    * \return 0 on success or a LaserPrinterError, see getLastErrorMessage() for the reason
+    */
     int printImage(uint8_t* image, int width, int height, bool enableFan) {
-        if (!m_connected || m_printing)
-            return -1;
-        if (width + m_printOriginX > LASER_PRINTER_RESOLUTION_WIDTH || height+ m_printOriginY > LASER_PRINTER_RESOLUTION_HEIGHT)
-            return -2;
-        m_printing = true;
-        if (!m_simulating) {
-            if (enableFan) {
-                m_serial->write("$10 P1000");
-                std::this_thread::sleep_for(std::chrono::milliseconds(50));
-            }
-            else {
-                m_serial->write("$10 P0");
-                std::this_thread::sleep_for(std::chrono::milliseconds(50));
-            }
-            //Send print order
-            m_serial->write("$30 P" + std::to_string(m_printOriginX) + " " + std::to_string(m_printOriginY) + (enableFan ? " P2" : " P0"));
-            std::this_thread::sleep_for(std::chrono::milliseconds(500));
-            m_serial->read();
-        }
+        return runJob(m_printOriginX, m_printOriginY, width, height, enableFan, NULL, [&](BatchQueue &queue) { encodeImage(image, width, height, queue); });
+    }
 
-        //Send print packets
-        LaserPrinterMove printPacket;
-        uint8_t printBuffer[LASER_PRINTER_MOVE_BUFFER_LENGHT * 4];
-        int bufferIndex = 0;
-        for (int y = 0; y < height; y++) {
-            for (int x = 0; x < width; x++) {
-                int xPos = x;
-                int index = y*width + x;
-                if (y % 2 == 0) {
-                    index = ((y + 1)*width - 1) - x;
-                    xPos = width - x -1;
-                }
-                if (image[index] != 0) {
-                    printPacket.x = xPos;
-                    printPacket.y = y;
-                    printPacket.duration = image[index];
-                    printPacket.toCommand(&printBuffer[bufferIndex]);
-                    bufferIndex += 4;
-                    if (bufferIndex >= LASER_PRINTER_MOVE_BUFFER_LENGHT * 4) {
-                        sendPrintBuffer(printBuffer);
-                        bufferIndex = 0;
-                    }
-                }
-            }
-        }
-        printPacket.x = 0;
-        printPacket.y = 0;
-        printPacket.duration = 0;
-        //buffer not full at print end
-        while(bufferIndex > 0 && bufferIndex < LASER_PRINTER_MOVE_BUFFER_LENGHT * 4) {
-            printPacket.toCommand(&printBuffer[bufferIndex]);
-            bufferIndex += 4;
-        }
-        if (bufferIndex > 0) {
-            sendPrintBuffer(printBuffer);
-        }
-        if (!m_simulating) {
-            m_serial->write("$33");
-            std::this_thread::sleep_for(std::chrono::milliseconds(50));
-            m_serial->read();
-        }
-        m_printing = false;
+    /**
+    * \brief Continue the printImage() job interrupted while the checkpoint file was set, from its first unacknowledged batch.
+    *   Same arguments as the interrupted call, the job is printed at the origin saved in the checkpoint.
+    * \return 0 on success or a LaserPrinterError, LASER_PRINTER_CHECKPOINT_ERROR if the checkpoint does not match this job
+    */
+    int resumeImage(uint8_t* image, int width, int height, bool enableFan) {
+        std::lock_guard<std::recursive_mutex> lock(m_mutex);
+        JobCheckpoint checkpoint;
+        int result = loadCheckpoint(width, height, enableFan, checkpoint);
+        if (result != LASER_PRINTER_OK)
+            return result;
+        return runJob(checkpoint.originX, checkpoint.originY, width, height, enableFan, &checkpoint, [&](BatchQueue &queue) { encodeImage(image, width, height, queue); });
     }
 
     /*
-    * \param power: laser power between 0 and 1
+    * \param power: laser power between 0 and 1, other values are ignored
     */
     void setLaserPower(float power) {
-        if (m_simulating)
+        if (!(power >= 0 && power <= 1))
             return;
         char power_str[10];
-        sprintf(power_str, "%.3f", power);
-        m_serial->write("$8 P"+ std::string(power_str));
-        std::this_thread::sleep_for(std::chrono::milliseconds(50));
+        snprintf(power_str, sizeof(power_str), "%.3f", power);
+        std::lock_guard<std::recursive_mutex> lock(m_mutex);
+        sendCommand("$8 P"+ std::string(power_str));
     }
 
     /*
-    * \param power: laser power between 0 and 1
+    * \param depth: engraving depth between 0 and 1, other values are ignored
     */
     void setEngravingDepth(float depth) {
-        if (m_simulating)
+        if (!(depth >= 0 && depth <= 1))
             return;
         char depth_str[10];
-        sprintf(depth_str, "%.3f", depth);
-        m_serial->write("$9 P" + std::string(depth_str));
-        std::this_thread::sleep_for(std::chrono::milliseconds(50));
+        snprintf(depth_str, sizeof(depth_str), "%.3f", depth);
+        std::lock_guard<std::recursive_mutex> lock(m_mutex);
+        sendCommand("$9 P" + std::string(depth_str));
     }
 
-    int printShape(std::vector<LaserPrinterSegment> &segments, int width, int height, bool enableFan) {
-        if (!m_connected || m_printing)
-            return -1;
-        if (width + m_printOriginX > LASER_PRINTER_RESOLUTION_WIDTH || height + m_printOriginY > LASER_PRINTER_RESOLUTION_HEIGHT)
-            return -2;
-        m_printing = true;
-        reorderSegments(segments);
-        if (!m_simulating) {
-            if (enableFan) {
-                m_serial->write("$10 P1000");
-                std::this_thread::sleep_for(std::chrono::milliseconds(50));
-            }
-            else {
-                m_serial->write("$10 P0");
-                std::this_thread::sleep_for(std::chrono::milliseconds(50));
-            }
-            //Send print order
-            m_serial->write("$30 P" + std::to_string(m_printOriginX) + " " + std::to_string(m_printOriginY) + (enableFan ? " P2" : " P0"));
-            std::this_thread::sleep_for(std::chrono::milliseconds(500));
-            m_serial->read();
+    /*
+    * \brief Print [segments] and return once done. Waits for the job running on another thread, if any.
+    * \return 0 on success or a LaserPrinterError, see getLastErrorMessage() for the reason
+    */
+    int printShape(const std::vector<LaserPrinterSegment> &segments, int width, int height, bool enableFan) {
+        return runJob(m_printOriginX, m_printOriginY, width, height, enableFan, NULL, [&](BatchQueue &queue) { encodeShape(segments, queue); });
+    }
+
+    /**
+    * \brief Continue the printShape() job interrupted while the checkpoint file was set, from its first unacknowledged batch.
+    *   Same arguments as the interrupted call, the job is printed at the origin saved in the checkpoint.
+    * \return 0 on success or a LaserPrinterError, LASER_PRINTER_CHECKPOINT_ERROR if the checkpoint does not match this job
+    */
+    int resumeShape(const std::vector<LaserPrinterSegment> &segments, int width, int height, bool enableFan) {
+        std::lock_guard<std::recursive_mutex> lock(m_mutex);
+        JobCheckpoint checkpoint;
+        int result = loadCheckpoint(width, height, enableFan, checkpoint);
+        if (result != LASER_PRINTER_OK)
+            return result;
+        return runJob(checkpoint.originX, checkpoint.originY, width, height, enableFan, &checkpoint, [&](BatchQueue &queue) { encodeShape(segments, queue); });
+    }
+
+    /**
+    * \brief Print a stream of moves already planned, in order, and return once done.
+    *   Waits for the job running on another thread, if any.
+    * \return 0 on success or a LaserPrinterError, see getLastErrorMessage() for the reason
+    */
+    int printMoves(const MoveBuffer &moves, int width, int height, bool enableFan) {
+        return runJob(m_printOriginX, m_printOriginY, width, height, enableFan, NULL, [&](BatchQueue &queue) { encodeMoves(moves, queue); });
+    }
+
+    int printMoves(const std::vector<LaserPrinterMove> &moves, int width, int height, bool enableFan) {
+        return printMoves(toMoveBuffer(moves), width, height, enableFan);
+    }
+
+    /**
+    * \brief Print [count] 4 bytes print packets already encoded, in order, and return once done.
+    *   The packets are read in place, e.g. from shared memory, and copied straight into the outgoing batches.
+    * \return 0 on success or a LaserPrinterError, see getLastErrorMessage() for the reason
+    */
+    int printPackets(const uint8_t* packets, size_t count, int width, int height, bool enableFan) {
+        return runJob(m_printOriginX, m_printOriginY, width, height, enableFan, NULL, [&](BatchQueue &queue) { encodePackets(packets, count, queue); });
+    }
+
+    /**
+    * \brief Plan and encode [segments] once, like printShape() would, for printProgram() or submitProgram().
+    */
+    static std::shared_ptr<const PrintProgram> compileShape(const std::vector<LaserPrinterSegment> &segments, int width, int height) {
+        std::shared_ptr<PrintProgram> program = std::make_shared<PrintProgram>(width, height);
+        encodeShape(segments, *program);
+        return program;
+    }
+
+    /**
+    * \brief Encode [image] once, like printImage() would, for printProgram() or submitProgram().
+    */
+    static std::shared_ptr<const PrintProgram> compileImage(const uint8_t* image, int width, int height) {
+        std::shared_ptr<PrintProgram> program = std::make_shared<PrintProgram>(width, height);
+        encodeImage(image, width, height, *program);
+        return program;
+    }
+
+    static std::shared_ptr<const PrintProgram> compileMoves(const MoveBuffer &moves, int width, int height) {
+        std::shared_ptr<PrintProgram> program = std::make_shared<PrintProgram>(width, height);
+        encodeMoves(moves, *program);
+        return program;
+    }
+
+    /**
+    * \brief Print a compiled program at the current print origin and return once done.
+    *   The batches are sent from the program as they are, nothing is planned, encoded nor copied.
+    * \return 0 on success or a LaserPrinterError, see getLastErrorMessage() for the reason
+    */
+    int printProgram(const PrintProgram &program, bool enableFan) {
+        return runProgram(m_printOriginX, m_printOriginY, program, enableFan, NULL);
+    }
+
+    /**
+    * \brief Continue the printProgram() job interrupted while the checkpoint file was set, see resumeShape().
+    */
+    int resumeProgram(const PrintProgram &program, bool enableFan) {
+        std::lock_guard<std::recursive_mutex> lock(m_mutex);
+        JobCheckpoint checkpoint;
+        int result = loadCheckpoint(program.width(), program.height(), enableFan, checkpoint);
+        if (result != LASER_PRINTER_OK)
+            return result;
+        return runProgram(checkpoint.originX, checkpoint.originY, program, enableFan, &checkpoint);
+    }
+
+    /**
+    * \brief Print a copy of [program] at each of [origins], in one print session, and return once done.
+    *   The copies are ordered to limit the head travel between them, and are offset while their batches are encoded:
+    *   nothing is planned again. The last batch of a copy is not padded, the next copy follows in the same batch.
+    * \return 0 on success or a LaserPrinterError, see getLastErrorMessage() for the reason,
+    *   LASER_PRINTER_OUT_OF_AREA if any copy does not fit in the printing area
+    */
+    int printStepAndRepeat(const PrintProgram &program, const std::vector<LaserPrintOrigin> &origins, bool enableFan) {
+        if (origins.empty())
+            return setError(LASER_PRINTER_PLANNING_ERROR, "no origin to print the copies at");
+        //Every copy in the area also bounds the offsets below: they fit the 12 bits of a packet
+        for (size_t i = 0; i < origins.size(); i++) {
+            if (!isInPrintArea(origins[i].x, origins[i].y, program.width(), program.height()))
+                return setError(LASER_PRINTER_OUT_OF_AREA, "copy " + std::to_string(i) + " is out of the printing area");
         }
+        std::vector<LaserPrintOrigin> ordered = orderOrigins(origins);
+        LaserPrintOrigin base = ordered[0];
+        for (size_t i = 1; i < ordered.size(); i++) {
+            base.x = (std::min)(base.x, ordered[i].x);
+            base.y = (std::min)(base.y, ordered[i].y);
+        }
+        uint64_t width = 0;
+        uint64_t height = 0;
+        for (size_t i = 0; i < ordered.size(); i++) {
+            ordered[i].x -= base.x;
+            ordered[i].y -= base.y;
+            width = (std::max)(width, static_cast<uint64_t>(ordered[i].x) + static_cast<uint64_t>(program.width()));
+            height = (std::max)(height, static_cast<uint64_t>(ordered[i].y) + static_cast<uint64_t>(program.height()));
+        }
+        return runJob(base.x, base.y, static_cast<int>(width), static_cast<int>(height), enableFan, NULL, [&](BatchQueue &queue) { encodeStepAndRepeat(program, ordered, queue); });
+    }
 
-        //Send print packets
-        uint8_t printBuffer[LASER_PRINTER_MOVE_BUFFER_LENGHT * 4];
-        int bufferIndex = 0;
-        for (int i = 0; i < segments.size(); i++) {
-            if (segments.at(i).duration != 0) {
-                std::vector<LaserPrinterMove> moves = segments.at(i).getInterpolation();
-                for (int p = 0; p < moves.size(); p++) {
-                    //avoid duplicates
-                    if (p == moves.size() - 1 && i + 1 < segments.size()) {
-                        if (moves.at(p).x == segments.at(i + 1).startX && moves.at(p).y == segments.at(i + 1).startY)
-                            continue;
-                    }
-                    moves.at(p).toCommand(&printBuffer[bufferIndex]);
-                    bufferIndex += 4;
-                    if (bufferIndex >= LASER_PRINTER_MOVE_BUFFER_LENGHT * 4) {
-                        sendPrintBuffer(printBuffer);
-                        bufferIndex = 0;
-                    }
-                }
-            }
+    /**
+    * \brief [columns] x [rows] origins, [stepX] [stepY] apart, the first one at [x] [y].
+    *   Origins past the unsigned range are saturated instead of wrapping, printStepAndRepeat() then rejects them.
+    */
+    static std::vector<LaserPrintOrigin> gridOrigins(unsigned int x, unsigned int y, unsigned int columns, unsigned int rows, unsigned int stepX, unsigned int stepY) {
+        std::vector<LaserPrintOrigin> origins;
+        for (unsigned int row = 0; row < rows; row++) {
+            for (unsigned int column = 0; column < columns; column++)
+                origins.push_back(LaserPrintOrigin(gridStep(x, column, stepX), gridStep(y, row, stepY)));
         }
+        return origins;
+    }
 
-        LaserPrinterMove printPacket;
-        //buffer not full at print end
-        while (bufferIndex > 0 && bufferIndex < LASER_PRINTER_MOVE_BUFFER_LENGHT * 4) {
-            printPacket.toCommand(&printBuffer[bufferIndex]);
-            bufferIndex += 4;
-        }
-        if (bufferIndex > 0) {
-            sendPrintBuffer(printBuffer);
-        }
-        if (!m_simulating) {
-            m_serial->write("$33");
-            std::this_thread::sleep_for(std::chrono::milliseconds(50));
-            while (m_serial->read().find("F22") == std::string::npos) {
-                std::this_thread::sleep_for(std::chrono::milliseconds(50));
+    /**
+    * \brief Print a compiled job file (.lpm, see PrintProgramFile) with its saved origin, fan, power and depth, and return once done.
+    *   The batches are streamed from the mapped file.
+    * \return 0 on success or a LaserPrinterError, LASER_PRINTER_PLANNING_ERROR if the file is not a valid compiled job
+    */
+    int printProgramFile(const std::string &path) {
+        std::lock_guard<std::recursive_mutex> lock(m_mutex);
+        PrintProgramSettings settings;
+        std::string error;
+        std::shared_ptr<const PrintProgram> program = PrintProgramFile::load(path, settings, error);
+        if (!program)
+            return setError(LASER_PRINTER_PLANNING_ERROR, error);
+        if (settings.power >= 0)
+            setLaserPower(settings.power);
+        if (settings.depth >= 0)
+            setEngravingDepth(settings.depth);
+        return runProgram(settings.originX, settings.originY, *program, settings.fan, NULL);
+    }
+
+    /**
+    * \brief Queue [image] to be printed by the worker thread at the current print origin, and return immediately.
+    *   The image is copied, it can be reused as soon as this returns. Jobs are printed one at a time in submission order.
+    */
+    LaserPrintJob submitImage(const uint8_t* image, int width, int height, bool enableFan) {
+        std::shared_ptr<const std::vector<uint8_t> > pixels = std::make_shared<std::vector<uint8_t> >(image, image + width * height);
+        return submit(imageJob(pixels, m_printOriginX, m_printOriginY, width, height, enableFan));
+    }
+
+    /**
+    * \brief Queue [segments] to be printed by the worker thread at the current print origin, and return immediately.
+    *   The segments are copied, they can be modified as soon as this returns. Jobs are printed one at a time in submission order.
+    */
+    LaserPrintJob submitShape(const std::vector<LaserPrinterSegment> &segments, int width, int height, bool enableFan) {
+        std::shared_ptr<const std::vector<LaserPrinterSegment> > shape = std::make_shared<std::vector<LaserPrinterSegment> >(segments);
+        return submit(shapeJob(shape, m_printOriginX, m_printOriginY, width, height, enableFan));
+    }
+
+    /**
+    * \brief Queue [planner] and the print of its segments on the worker thread at the current print origin, and return immediately.
+    *   The planning runs on the worker thread too, in its turn: the caller never waits for it.
+    */
+    LaserPrintJob submitShape(LaserShapePlanner planner, bool enableFan) {
+        unsigned int originX = m_printOriginX;
+        unsigned int originY = m_printOriginY;
+        return submit([this, planner, originX, originY, enableFan]() {
+            int width = 0;
+            int height = 0;
+            std::vector<LaserPrinterSegment> segments = planner(width, height);
+            if (segments.empty())
+                return setError(LASER_PRINTER_PLANNING_ERROR, "the job has nothing to print");
+            return runJob(originX, originY, width, height, enableFan, NULL, [&](BatchQueue &queue) { encodeShape(segments, queue); });
+        });
+    }
+
+    /**
+    * \brief Queue [moves] to be printed by the worker thread at the current print origin, and return immediately.
+    *   The moves are copied. Jobs are printed one at a time in submission order.
+    */
+    LaserPrintJob submitMoves(const MoveBuffer &moves, int width, int height, bool enableFan) {
+        std::shared_ptr<const MoveBuffer> stream = std::make_shared<MoveBuffer>(moves);
+        unsigned int originX = m_printOriginX;
+        unsigned int originY = m_printOriginY;
+        return submit([=]() {
+            return runJob(originX, originY, width, height, enableFan, NULL, [=](BatchQueue &queue) { encodeMoves(*stream, queue); });
+        });
+    }
+
+    LaserPrintJob submitMoves(const std::vector<LaserPrinterMove> &moves, int width, int height, bool enableFan) {
+        return submitMoves(toMoveBuffer(moves), width, height, enableFan);
+    }
+
+    /**
+    * \brief Queue 4 bytes print packets already encoded, see printPackets(), to be printed by the worker thread
+    *   at the current print origin, and return immediately. The packets are copied and sent unchanged.
+    */
+    LaserPrintJob submitPackets(const std::vector<uint8_t> &packets, int width, int height, bool enableFan) {
+        std::shared_ptr<const std::vector<uint8_t> > stream = std::make_shared<std::vector<uint8_t> >(packets);
+        unsigned int originX = m_printOriginX;
+        unsigned int originY = m_printOriginY;
+        return submit([=]() {
+            return runJob(originX, originY, width, height, enableFan, NULL, [=](BatchQueue &queue) { encodePackets(stream->data(), stream->size() / 4, queue); });
+        });
+    }
+
+    /**
+    * \brief Queue [program] to be printed by the worker thread at the current print origin, and return immediately.
+    *   The program is shared, not copied: queue the same one as many times as needed.
+    */
+    LaserPrintJob submitProgram(std::shared_ptr<const PrintProgram> program, bool enableFan) {
+        return submit(programJob(program, m_printOriginX, m_printOriginY, enableFan));
+    }
+
+    /**
+    * \brief Queue printStepAndRepeat() on the worker thread, and return immediately. The program is shared, the origins copied.
+    */
+    LaserPrintJob submitStepAndRepeat(std::shared_ptr<const PrintProgram> program, const std::vector<LaserPrintOrigin> &origins, bool enableFan) {
+        return submit([this, program, origins, enableFan]() { return printStepAndRepeat(*program, origins, enableFan); });
+    }
+
+    /**
+    * \brief Queue the compiled job file [path] to be printed by the worker thread, see printProgramFile(), and return immediately.
+    */
+    LaserPrintJob submitProgramFile(const std::string &path) {
+        return submit([this, path]() { return printProgramFile(path); });
+    }
+
+    /**
+    * \brief Queue [task] on the worker thread, between the submitted jobs: e.g. settings for the jobs queued after it.
+    *   [task] returns 0 or a LaserPrinterError.
+    */
+    LaserPrintJob submitTask(std::function<int(LaserPrinter&)> task) {
+        return submit([this, task]() { return task(*this); });
+    }
+
+private:
+    friend class LaserPrinterFarm;
+    friend class SharedJobReceiver;
+
+    std::function<int()> imageJob(std::shared_ptr<const std::vector<uint8_t> > pixels, unsigned int originX, unsigned int originY, int width, int height, bool enableFan) {
+        return [=]() {
+            return runJob(originX, originY, width, height, enableFan, NULL, [=](BatchQueue &queue) { encodeImage(pixels->data(), width, height, queue); });
+        };
+    }
+
+    std::function<int()> shapeJob(std::shared_ptr<const std::vector<LaserPrinterSegment> > shape, unsigned int originX, unsigned int originY, int width, int height, bool enableFan) {
+        return [=]() {
+            return runJob(originX, originY, width, height, enableFan, NULL, [=](BatchQueue &queue) { encodeShape(*shape, queue); });
+        };
+    }
+
+    std::function<int()> programJob(std::shared_ptr<const PrintProgram> program, unsigned int originX, unsigned int originY, bool enableFan) {
+        return [=]() {
+            return runProgram(originX, originY, *program, enableFan, NULL);
+        };
+    }
+
+    /**
+    * \brief Print [run] on the calling thread on behalf of the submitted job [state], which gets the progress and the result.
+    */
+    void execute(LaserPrintJobState* state, const std::function<int()> &run) {
+        if (state->cancelled) {
+            state->finish(LASER_PRINTER_ABORTED, "cancelled before it started");
+            return;
+        }
+        std::unique_lock<std::recursive_mutex> lock(m_mutex);
+        m_job = state;
+        int result = run();
+        m_job = NULL;
+        lock.unlock();
+        std::string message = result != LASER_PRINTER_OK ? getLastErrorMessage() : "";
+        state->finish(result, message);
+    }
+
+    LaserPrintJob submit(std::function<int()> run) {
+        LaserPrinterPendingJob job;
+        job.state = std::make_shared<LaserPrintJobState>();
+        job.run = run;
+        std::lock_guard<std::mutex> lock(m_workerMutex);
+        if (!m_worker.joinable())
+            m_worker = std::thread([this]() { runWorker(); });
+        m_activeJobs++;
+        m_pendingJobs.push_back(job);
+        m_workerWakeUp.notify_one();
+        return LaserPrintJob(job.state);
+    }
+
+    /**
+    * \brief Worker thread: print the submitted jobs in order, until stopWorker().
+    */
+    void runWorker() {
+        while (true) {
+            LaserPrinterPendingJob job;
+            {
+                std::unique_lock<std::mutex> lock(m_workerMutex);
+                m_workerWakeUp.wait(lock, [this]() { return m_stopWorker || !m_pendingJobs.empty(); });
+                if (m_pendingJobs.empty())
+                    return;
+                job = m_pendingJobs.front();
+                m_pendingJobs.pop_front();
+                m_runningJob = job.state;
             }
+            execute(job.state.get(), job.run);
+            std::lock_guard<std::mutex> lock(m_workerMutex);
+            m_runningJob.reset();
+            m_activeJobs--;
+        }
+    }
+
+    /**
+    * \brief Cancel the running and pending jobs and join the worker thread.
+    */
+    void stopWorker() {
+        {
+            std::lock_guard<std::mutex> lock(m_workerMutex);
+            m_stopWorker = true;
+            if (m_runningJob)
+                m_runningJob->cancelled = true;
+            for (size_t i = 0; i < m_pendingJobs.size(); i++)
+                m_pendingJobs[i].state->cancelled = true;
+            m_workerWakeUp.notify_all();
+        }
+        if (m_worker.joinable())
+            m_worker.join();
+    }
+
+    /**
+    * \brief Whether the running job was stopped by abort() or through its LaserPrintJob handle.
+    */
+    bool isCancelled() {
+        return m_abortRequested || (m_job != NULL && m_job->cancelled);
+    }
+
+    /**
+    * \brief Print the batches produced by [encode], encoding runs on its own thread while the previous batch is acknowledged.
+    * \param resumeFrom: checkpoint of an interrupted run of the same job, its acknowledged batches are encoded again but not sent. NULL for a new job.
+    */
+    int runJob(unsigned int originX, unsigned int originY, int width, int height, bool enableFan, const JobCheckpoint* resumeFrom, std::function<void(BatchQueue&)> encode) {
+        std::lock_guard<std::recursive_mutex> lock(m_mutex);
+        int window = m_batchWindow;
+        BatchQueue queue(LASER_PRINTER_MOVE_BUFFER_LENGHT * 4, window + 1);
+        return runQueue(originX, originY, width, height, enableFan, resumeFrom, window, queue, encode);
+    }
+
+    /**
+    * \brief Print the batches of [program], read in place.
+    */
+    int runProgram(unsigned int originX, unsigned int originY, const PrintProgram &program, bool enableFan, const JobCheckpoint* resumeFrom) {
+        BatchQueue queue(program.batches(), program.batchSize(), program.batchCount());
+        return runQueue(originX, originY, program.width(), program.height(), enableFan, resumeFrom, m_batchWindow, queue, std::function<void(BatchQueue&)>());
+    }
+
+    /**
+    * \brief Print the batches of [queue]. [encode], if any, fills it from its own thread while they are sent.
+    * \param window: batch window of the job, [queue] must hold at least that many batches
+    */
+    int runQueue(unsigned int originX, unsigned int originY, int width, int height, bool enableFan, const JobCheckpoint* resumeFrom, int window, BatchQueue &queue, std::function<void(BatchQueue&)> encode) {
+        std::lock_guard<std::recursive_mutex> lock(m_mutex);
+        int result = checkJob(originX, originY, width, height);
+        if (result == LASER_PRINTER_OK && isCancelled())
+            result = setError(LASER_PRINTER_ABORTED, "aborted before it started");
+        if (result != LASER_PRINTER_OK) {
+            endControlRequests();
+            return result;
+        }
+        m_printing = true;
+        m_checkpoint = JobCheckpoint();
+        m_checkpoint.originX = originX;
+        m_checkpoint.originY = originY;
+        m_checkpoint.width = width;
+        m_checkpoint.height = height;
+        m_checkpoint.fan = enableFan;
+
+        std::string checkpointPath = getCheckpointPath();
+        if (!checkpointPath.empty())
+            m_checkpointWriter.start(checkpointPath);
+        std::thread encoder;
+        if (encode)
+            encoder = std::thread([&]() { encode(queue); });
+        if (resumeFrom != NULL)
+            result = skipBatches(queue, *resumeFrom);
+        bool started = result == LASER_PRINTER_OK;
+        if (started) {
+            startJob(originX, originY, enableFan);
+            result = streamBatches(queue, window);
+        }
+        else {
+            queue.abort();
+        }
+        if (encoder.joinable())
+            encoder.join();
+        if (started)
+            result = finishJob(result);
+        if (m_checkpointWriter.isRunning()) {
+            m_checkpointWriter.finish();
+            if (result == LASER_PRINTER_OK)
+                JobCheckpoint::remove(checkpointPath);
         }
         m_printing = false;
+        endControlRequests();
+        return result;
     }
 
-private:
-    void reorderSegments(std::vector<LaserPrinterSegment> &segments) {
+    /**
+    * \brief pause() and abort() requests apply to one job: they end with it, not when the next one starts,
+    *   so a request made just before a job starts is not lost.
+    */
+    void endControlRequests() {
+        m_pauseRequested = false;
+        m_abortRequested = false;
+    }
+
+    /**
+    * \brief Read the checkpoint file for a resume of the job [width] x [height].
+    */
+    int loadCheckpoint(int width, int height, bool enableFan, JobCheckpoint &checkpoint) {
+        std::string checkpointPath = getCheckpointPath();
+        if (checkpointPath.empty() || !checkpoint.load(checkpointPath))
+            return setError(LASER_PRINTER_CHECKPOINT_ERROR, "no checkpoint to resume");
+        JobCheckpoint job;
+        job.width = width;
+        job.height = height;
+        job.fan = enableFan;
+        if (!checkpoint.sameJob(job))
+            return setError(LASER_PRINTER_CHECKPOINT_ERROR, "the checkpoint belongs to another job");
+        return LASER_PRINTER_OK;
+    }
+
+    /**
+    * \brief Consume the batches already acknowledged before the job was interrupted, checking they are the same.
+    */
+    int skipBatches(BatchQueue &queue, const JobCheckpoint &resumeFrom) {
+        while (m_checkpoint.batches < resumeFrom.batches) {
+            const uint8_t* batch = queue.peek(0);
+            if (batch == NULL)
+                return setError(LASER_PRINTER_CHECKPOINT_ERROR, "the job has fewer batches than the checkpoint");
+            m_checkpoint.add(batch, queue.batchSize());
+            queue.commitRead();
+        }
+        if (m_checkpoint.checksum != resumeFrom.checksum)
+            return setError(LASER_PRINTER_CHECKPOINT_ERROR, "the job does not match the checkpoint");
+        return LASER_PRINTER_OK;
+    }
+
+    /**
+    * \brief Fan and "$30" print order at [originX] [originY], the printer then expects batches of moves.
+    */
+    void startJob(unsigned int originX, unsigned int originY, bool enableFan) {
+        //The printer may still be burning the end of the previous job, its "F22" would be taken for the answer to "$30"
+        if (m_endPending)
+            waitForToken(m_transport, "F22", m_ackTimeoutMs, &m_abortRequested, m_job != NULL ? &m_job->cancelled : NULL);
+        m_endPending = false;
+        m_jobOriginX = originX;
+        m_jobOriginY = originY;
+        m_jobFan = enableFan;
+        sendCommand(enableFan ? "$10 P1000" : "$10 P0");
+        //Send print order
+        sendCommand("$30 P" + std::to_string(originX) + " " + std::to_string(originY) + (enableFan ? " P2" : " P0"));
+    }
+
+    /**
+    * \brief "$33" end of print, wait for the printer to report the job finished with "F22". The wait stops on abort().
+    * \return 0 on success, LASER_PRINTER_END_TIMEOUT if the printer did not report the end of the job in time,
+    *   LASER_PRINTER_ABORTED if the wait was given up
+    */
+    int endJob() {
+        bool ended = m_transport->write("$33")
+            && waitForToken(m_transport, "F22", m_ackTimeoutMs, &m_abortRequested, m_job != NULL ? &m_job->cancelled : NULL);
+        m_endPending = !ended;
+        if (!ended && isCancelled())
+            return setError(LASER_PRINTER_ABORTED, "aborted while the printer finished the job");
+        if (!ended)
+            return setError(LASER_PRINTER_END_TIMEOUT, "the printer did not report the end of the job (F22) in time");
+        return LASER_PRINTER_OK;
+    }
+
+    /**
+    * \brief Common checks before a print job.
+    */
+    int checkJob(unsigned int originX, unsigned int originY, int width, int height) {
+        if (!m_connected)
+            return setError(LASER_PRINTER_NOT_READY, "not connected");
+        if (m_printing)
+            return setError(LASER_PRINTER_NOT_READY, "a job is already printing");
+        if (!isInPrintArea(originX, originY, width, height))
+            return setError(LASER_PRINTER_OUT_OF_AREA, "the job is out of the printing area");
+        return setError(LASER_PRINTER_OK, "");
+    }
+
+    /**
+    * \brief End the job after streaming: "$33" and wait for "F22" on success,
+    *   otherwise still send "$33" so the printer leaves the print mode, without waiting long for it.
+    * \param streamResult: result of streamBatches()
+    */
+    int finishJob(int streamResult) {
+        if (streamResult == LASER_PRINTER_OK)
+            return endJob();
+        m_transport->write("$33");
+        m_endPending = !waitForResponse("F22", LASER_PRINTER_ABORT_TIMEOUT_MS);
+        return streamResult;
+    }
+
+    /**
+    * \brief Record the outcome of the last operation.
+    * \return [error]
+    */
+    int setError(int error, const std::string &message) {
+        std::lock_guard<std::mutex> lock(m_stateMutex);
+        m_lastError = error;
+        m_lastErrorMessage = message;
+        return error;
+    }
+
+    std::string getCheckpointPath() {
+        std::lock_guard<std::mutex> lock(m_stateMutex);
+        return m_checkpointPath;
+    }
+
+    /**
+    * \brief Cache the name of the link, getPortName() must not wait for the job using it.
+    */
+    void setPortName() {
+        std::string name = m_transport != NULL ? m_transport->name() : "";
+        std::lock_guard<std::mutex> lock(m_stateMutex);
+        m_portName = name;
+    }
+
+    /**
+    * \brief Wait a little longer for the acknowledgements of the [inFlight] batches sent, one at a time.
+    * \return the number of "B1" received: the oldest batches in flight they answer are done.
+    */
+    size_t drainAcks(size_t inFlight) {
+        size_t late = 0;
+        while (late < inFlight && waitForResponse("B1", LASER_PRINTER_ABORT_TIMEOUT_MS))
+            late++;
+        return late;
+    }
+
+    /**
+    * \brief Recover a print session after a lost acknowledgement, once the late ones are drained (see drainAcks()).
+    *   The printer may hold any part of a batch: "$33" would be taken as batch data. Empty packets are sent
+    *   LASER_PRINTER_RESYNC_CHUNK bytes at a time until a "B1" tells that batch is complete, the printer then holds
+    *   less than a chunk of the next one. All of that next batch but a chunk is sent at once, then one byte at a time
+    *   until its "B1": the printer is at a batch boundary without any byte to spare. The job is then ended,
+    *   every "B1" before "F22" is stale and dropped, and it is started again at the same origin.
+    * \param stepMs: how long the batch completed by the first chunks takes to be processed, part of its moves may burn.
+    * \return false if the end of the batch was not found or the printer did not end the job.
+    */
+    bool resyncJob(int stepMs) {
+        uint8_t emptyBatch[LASER_PRINTER_MOVE_BUFFER_LENGHT * 4];
+        memset(emptyBatch, 0, sizeof(emptyBatch));
+        size_t sent = 0;
+        do {
+            if (sent >= sizeof(emptyBatch) || !m_transport->write(emptyBatch, LASER_PRINTER_RESYNC_CHUNK))
+                return false;
+            sent += LASER_PRINTER_RESYNC_CHUNK;
+        } while (!waitForResponse("B1", stepMs));
+        if (!m_transport->write(emptyBatch, sizeof(emptyBatch) - LASER_PRINTER_RESYNC_CHUNK))
+            return false;
+        bool boundary = false;
+        for (size_t i = 0; i < LASER_PRINTER_RESYNC_CHUNK && !boundary; i++) {
+            if (!m_transport->write(emptyBatch, 1))
+                return false;
+            boundary = waitForResponse("B1", LASER_PRINTER_RESYNC_STEP_MS);
+        }
+        if (!boundary || !m_transport->write("$33"))
+            return false;
+        const char* tokens[2] = { "F22", "B1" };
+        int matched;
+        while ((matched = m_transport->waitFor(tokens, 2, m_ackTimeoutMs)) == 1)
+            ;
+        if (matched != 0)
+            return false;
+        startJob(m_jobOriginX, m_jobOriginY, m_jobFan);
+        return true;
+    }
+
+    /**
+    * \brief Send a "$" command and return as soon as the firmware answered it, or at its deadline.
+    *   Commands have no terminator: the firmware splits them on silence, the deadline of
+    *   commands it does not answer ($8, $9, $10) is that minimum gap.
+    * \return false if the expected answer did not arrive before the deadline
+    */
+    bool sendCommand(const std::string &command) {
+        const LaserPrinterCommandSpec &spec = getCommandSpec(command);
+        if (!m_transport->write(command))
+            return false;
+        int deadlineMs = spec.deadlineMs < 0 ? m_ackTimeoutMs.load() : spec.deadlineMs;
+        return waitForResponse(spec.reply, deadlineMs);
+    }
+
+    static const LaserPrinterCommandSpec &getCommandSpec(const std::string &command) {
+        static const LaserPrinterCommandSpec specs[] = {
+            { "$40", "connect", 3000 },     // home position, handshake
+            { "$42", "", 3000 },            // reset origin
+            { "$20", "", 2000 },            // start area preview
+            { "$25", "", 2000 },            // stop area preview
+            { "$30", "", 500 },             // print order
+            { "$33", "F22", -1 },           // end of print, answered once the last move is burnt
+            { "$8", NULL, 50 },             // laser power
+            { "$9", NULL, 50 },             // engraving depth
+            { "$10", NULL, 50 },            // fan
+        };
+        static const LaserPrinterCommandSpec unknown = { "", NULL, 50 };
+        for (size_t i = 0; i < sizeof(specs) / sizeof(specs[0]); i++) {
+            size_t codeLength = strlen(specs[i].code);
+            if (command.compare(0, codeLength, specs[i].code) == 0 && (command.length() == codeLength || command[codeLength] == ' '))
+                return specs[i];
+        }
+        return unknown;
+    }
+
+    static void reorderSegments(std::vector<LaserPrinterSegment> &segments) {
         int startIndex = 0;
         int endIndex = 0;
         bool startFound = false;
@@ -397,48 +1240,444 @@ private:
         }
     }
 
-    void sendPrintBuffer(uint8_t* buffer) {
-        if (!m_simulating) {
-            std::this_thread::sleep_for(std::chrono::milliseconds(50));
-            std::string msg((char*)buffer, LASER_PRINTER_MOVE_BUFFER_LENGHT * 4);
-            m_serial->write(msg);
-            while (m_serial->read().find("B1") == std::string::npos) {
-                std::this_thread::sleep_for(std::chrono::milliseconds(50));
+    /**
+    * \brief Producer: rasterize an image into move batches, serpentine scan.
+    *   The encoders write to a BatchQueue while printing, or to a PrintProgram when compiling.
+    */
+    template <class BatchSink>
+    static void encodeImage(const uint8_t* image, int width, int height, BatchSink &queue) {
+        MoveBuffer moves;
+        moves.reserve(LASER_PRINTER_MOVE_BUFFER_LENGHT);
+        for (int y = 0; y < height; y++) {
+            for (int x = 0; x < width; x++) {
+                int xPos = x;
+                int index = y*width + x;
+                if (y % 2 == 0) {
+                    index = ((y + 1)*width - 1) - x;
+                    xPos = width - x -1;
+                }
+                if (image[index] != 0) {
+                    moves.push_back(xPos, y, image[index]);
+                    if (moves.size() == LASER_PRINTER_MOVE_BUFFER_LENGHT && !writeBatches(moves, 1, queue))
+                        return;
+                }
             }
         }
-        else {
-#ifdef WITH_OPENCV
-            displayPrintBuffer(buffer);
-#endif
-        }
-    }
-
-#ifdef WITH_OPENCV
-    void displayPrintBuffer(uint8_t* buffer) {
-        LaserPrinterMove move;
-        for (int i = 0; i < LASER_PRINTER_MOVE_BUFFER_LENGHT * 4; i+=4) {
-            move.fromCommand(buffer + i);
-            int x = m_printOriginX + move.x;
-            int y = m_printOriginY + move.y;
-            if (x >= LASER_PRINTER_RESOLUTION_WIDTH) x = LASER_PRINTER_RESOLUTION_WIDTH-1;
-            if (y >= LASER_PRINTER_RESOLUTION_HEIGHT) y = LASER_PRINTER_RESOLUTION_HEIGHT-1;
-            if (x < 0) x = 0;
-            if (y < 0) y = 0;
-            m_previewImage.at<uint8_t>(y, x) = move.duration;
-        }
-        cv::imshow("preview", m_previewImage);
-        cv::waitKey(1);
-    }
-    cv::Mat m_previewImage;
-#endif
-
-    std::string m_serialPort;
-    SerialPort* m_serial;
-    bool m_connected;
-    unsigned int m_printOriginX;
-    unsigned int m_printOriginY;
-    bool m_printing;
-    bool m_simulating;
+        if (writeBatches(moves, moves.batchCount(), queue))
+            queue.close();
+    }
+
+    /**
+    * \brief Producer: encode planned moves into batches as they are.
+    */
+    template <class BatchSink>
+    static void encodeMoves(const MoveBuffer &moves, BatchSink &queue) {
+        for (size_t i = 0; i < moves.batchCount(); i++) {
+            uint8_t* printBuffer = queue.beginWrite();
+            if (printBuffer == NULL)
+                return;
+            moves.encodeBatch(i, printBuffer);
+            queue.commitWrite();
+        }
+        queue.close();
+    }
+
+    static MoveBuffer toMoveBuffer(const std::vector<LaserPrinterMove> &moves) {
+        MoveBuffer buffer;
+        buffer.reserve(moves.size());
+        for (size_t i = 0; i < moves.size(); i++)
+            buffer.push_back(moves[i]);
+        return buffer;
+    }
+
+    /**
+    * \brief Producer: copy encoded print packets into batches, a full batch at a time.
+    */
+    template <class BatchSink>
+    static void encodePackets(const uint8_t* packets, size_t count, BatchSink &queue) {
+        size_t length = count * 4;
+        size_t offset = 0;
+        while (offset < length) {
+            uint8_t* printBuffer = queue.beginWrite();
+            if (printBuffer == NULL)
+                return;
+            size_t chunk = (std::min)(queue.batchSize(), length - offset);
+            memcpy(printBuffer, packets + offset, chunk);
+            offset += chunk;
+            if (chunk < queue.batchSize()) {
+                finishBatches(printBuffer, chunk, queue);
+                return;
+            }
+            queue.commitWrite();
+        }
+        queue.close();
+    }
+
+    /**
+    * \brief Producer: reorder a copy of [segments] to limit the head travel, then encode it.
+    *   The caller's segments are left untouched so a resumed job encodes exactly the same batches.
+    */
+    template <class BatchSink>
+    static void encodeShape(const std::vector<LaserPrinterSegment> &segments, BatchSink &queue) {
+        std::vector<LaserPrinterSegment> ordered(segments);
+        reorderSegments(ordered);
+        encodeSegments(ordered, queue);
+    }
+
+    /**
+    * \brief Producer: interpolate segments into move batches.
+    */
+    template <class BatchSink>
+    static void encodeSegments(const std::vector<LaserPrinterSegment> &segments, BatchSink &queue) {
+        MoveBuffer moves;
+        for (int i = 0; i < segments.size(); i++) {
+            if (segments.at(i).duration != 0) {
+                segments.at(i).interpolate(moves);
+                //avoid duplicates
+                if (i + 1 < segments.size()) {
+                    PackedMove last = moves.at(moves.size() - 1);
+                    if (last.x() == segments.at(i + 1).startX && last.y() == segments.at(i + 1).startY)
+                        moves.pop_back();
+                }
+                if (!writeBatches(moves, moves.fullBatchCount(), queue))
+                    return;
+            }
+        }
+        if (writeBatches(moves, moves.batchCount(), queue))
+            queue.close();
+    }
+
+    /**
+    * \brief Producer: encode the first [count] batches of [moves] in bulk into the queue, and remove them.
+    * \return false if the consumer aborted
+    */
+    template <class BatchSink>
+    static bool writeBatches(MoveBuffer &moves, size_t count, BatchSink &queue) {
+        for (size_t i = 0; i < count; i++) {
+            uint8_t* printBuffer = queue.beginWrite();
+            if (printBuffer == NULL)
+                return false;
+            moves.encodeBatch(i, printBuffer);
+            queue.commitWrite();
+        }
+        moves.eraseBatches(count);
+        return true;
+    }
+
+    /**
+    * \brief Producer: the moves of [program] once per offset in [offsets], packed in batches across the copies.
+    *   The offsets are checked by printStepAndRepeat(): within the printing area, they fit a packet coordinate.
+    */
+    template <class BatchSink>
+    static void encodeStepAndRepeat(const PrintProgram &program, const std::vector<LaserPrintOrigin> &offsets, BatchSink &queue) {
+        //The empty packets padding the last batch are not part of the job
+        size_t packets = program.batchCount() * LASER_PRINTER_MOVE_BUFFER_LENGHT;
+        static const uint8_t empty[4] = { 0, 0, 0, 0 };
+        while (packets > 0 && memcmp(program.batches() + (packets - 1) * 4, empty, 4) == 0)
+            packets--;
+        MoveBuffer moves;
+        for (size_t i = 0; i < offsets.size(); i++) {
+            for (size_t first = 0; first < packets; first += LASER_PRINTER_MOVE_BUFFER_LENGHT) {
+                size_t count = (std::min)(static_cast<size_t>(LASER_PRINTER_MOVE_BUFFER_LENGHT), packets - first);
+                moves.appendPackets(program.batches() + first * 4, count, static_cast<uint16_t>(offsets[i].x), static_cast<uint16_t>(offsets[i].y));
+                if (!writeBatches(moves, moves.fullBatchCount(), queue))
+                    return;
+            }
+        }
+        if (writeBatches(moves, moves.batchCount(), queue))
+            queue.close();
+    }
+
+    static unsigned int gridStep(unsigned int first, unsigned int index, unsigned int step) {
+        uint64_t position = static_cast<uint64_t>(first) + static_cast<uint64_t>(index) * step;
+        return static_cast<unsigned int>((std::min)(position, static_cast<uint64_t>(UINT_MAX)));
+    }
+
+    /**
+    * \brief Nearest neighbour tour of [origins], from the one closest to the top left corner.
+    */
+    static std::vector<LaserPrintOrigin> orderOrigins(std::vector<LaserPrintOrigin> origins) {
+        std::vector<LaserPrintOrigin> ordered;
+        ordered.reserve(origins.size());
+        LaserPrintOrigin position(0, 0);
+        while (!origins.empty()) {
+            size_t nearest = 0;
+            long long nearestDistance = -1;
+            for (size_t i = 0; i < origins.size(); i++) {
+                long long dx = static_cast<long long>(origins[i].x) - position.x;
+                long long dy = static_cast<long long>(origins[i].y) - position.y;
+                long long distance = dx * dx + dy * dy;
+                if (nearestDistance < 0 || distance < nearestDistance) {
+                    nearest = i;
+                    nearestDistance = distance;
+                }
+            }
+            position = origins[nearest];
+            ordered.push_back(position);
+            origins.erase(origins.begin() + nearest);
+        }
+        return ordered;
+    }
+
+    /**
+    * \brief Producer: pad the last batch of raw packets with empty packets, publish it and close the queue.
+    */
+    template <class BatchSink>
+    static void finishBatches(uint8_t* printBuffer, size_t bufferIndex, BatchSink &queue) {
+        //buffer not full at print end
+        if (printBuffer != NULL) {
+            memset(printBuffer + bufferIndex, 0, queue.batchSize() - bufferIndex);
+            queue.commitWrite();
+        }
+        queue.close();
+    }
+
+    /**
+    * \brief Consumer: send every batch produced in [queue], in order, keeping up to the batch window unacknowledged.
+    *   Sent batches stay in the queue until their "B1" arrives.
+    *   A missing acknowledgement is handled by the recovery policy: the late "B1" are drained, then the batches
+    *   still in flight are sent again, after a resync of the session for LASER_PRINTER_RECOVERY_RESYNC.
+    *   pause() and abort() are checked before every batch and during the ack waits.
+    * \param window: batches sent ahead of their acknowledgement, [queue] must hold at least that many
+    * \param linkTest: NULL for a job, otherwise the acknowledgements are timed into it instead of training the pacer
+    * \return 0 when the queue is drained, a LaserPrinterError otherwise (the producer is then aborted).
+    */
+    int streamBatches(BatchQueue &queue, int window, LaserLinkSamples* linkTest = NULL) {
+        const LaserPrinterRecovery recovery = m_recovery;
+        const int maxRetries = m_maxRetries;
+        std::vector<BatchFlight> flights(window);
+        size_t oldest = 0;
+        size_t inFlight = 0;
+        int retries = 0;
+        int headX = 0;
+        int headY = 0;
+        std::chrono::steady_clock::time_point lastAck = std::chrono::steady_clock::now();
+        while (true) {
+            if (isCancelled()) {
+                queue.abort();
+                return setError(LASER_PRINTER_ABORTED, "print aborted at batch " + std::to_string(m_checkpoint.batches));
+            }
+            bool paused = m_pauseRequested;
+            const uint8_t* batch = inFlight < flights.size() && !paused ? queue.peek(inFlight) : NULL;
+            if (batch != NULL) {
+                BatchFlight &flight = flights[(oldest + inFlight) % flights.size()];
+                flight.workload = AckPacer::measure(batch, queue.batchSize(), headX, headY);
+                if (!m_transport->write(batch, queue.batchSize())) {
+                    queue.abort();
+                    return setError(LASER_PRINTER_LINK_ERROR, "could not write batch " + std::to_string(m_checkpoint.batches + inFlight));
+                }
+                flight.sent = std::chrono::steady_clock::now();
+                if (m_job != NULL) {
+                    m_job->batchesSent++;
+                    m_job->movesSent += countMoves(batch, queue.batchSize());
+                }
+                inFlight++;
+                continue;
+            }
+            if (inFlight == 0 && paused) {
+                std::this_thread::sleep_for(std::chrono::milliseconds(LASER_PRINTER_CONTROL_POLL_MS));
+                continue;
+            }
+            if (inFlight == 0)
+                return queue.isAborted() ? setError(LASER_PRINTER_ACK_TIMEOUT, "print aborted") : LASER_PRINTER_OK;
+            BatchFlight &flight = flights[oldest];
+            //The firmware works on a batch once received and the previous one is done
+            std::chrono::steady_clock::time_point start = (std::max)(flight.sent, lastAck);
+            waitForPredictedAck(flight.workload, start);
+            int deadlineMs = linkTest != NULL ? linkTest->ackTimeoutMs : getAckDeadlineMs(flight.workload);
+            if (!waitForToken(m_transport, "B1", deadlineMs, &m_abortRequested, m_job != NULL ? &m_job->cancelled : NULL)) {
+                if (isCancelled())
+                    continue;
+                if (linkTest != NULL)
+                    linkTest->lostAcks++;
+                //A late "B1" is not a loss: the batch it answers must not be sent again, nor its "B1" counted for the resent one
+                size_t late = recovery != LASER_PRINTER_RECOVERY_ABORT ? drainAcks(inFlight) : 0;
+                for (size_t i = 0; i < late; i++) {
+                    if (linkTest != NULL)
+                        linkTest->ackLatenciesMs.push_back(elapsedMs(flights[oldest].sent));
+                    acknowledgeBatch(queue);
+                    oldest = (oldest + 1) % flights.size();
+                    inFlight--;
+                }
+                if (late > 0) {
+                    lastAck = std::chrono::steady_clock::now();
+                    continue;
+                }
+                if (recovery == LASER_PRINTER_RECOVERY_ABORT || retries >= maxRetries) {
+                    queue.abort();
+                    return setError(LASER_PRINTER_ACK_TIMEOUT, "batch " + std::to_string(m_checkpoint.batches) + " not acknowledged"
+                        + (retries > 0 ? " after " + std::to_string(retries) + " retries" : ""));
+                }
+                retries++;
+                if (recovery == LASER_PRINTER_RECOVERY_RESYNC && !resyncJob(getResyncStepMs(flight.workload))) {
+                    queue.abort();
+                    return setError(LASER_PRINTER_ACK_TIMEOUT, "batch " + std::to_string(m_checkpoint.batches) + " not acknowledged, resync failed");
+                }
+                //Send again every batch in flight, oldest first
+                for (size_t i = 0; i < inFlight; i++) {
+                    BatchFlight &resent = flights[(oldest + i) % flights.size()];
+                    if (!m_transport->write(queue.peek(i), queue.batchSize())) {
+                        queue.abort();
+                        return setError(LASER_PRINTER_LINK_ERROR, "could not write batch " + std::to_string(m_checkpoint.batches + i));
+                    }
+                    resent.sent = std::chrono::steady_clock::now();
+                }
+                lastAck = std::chrono::steady_clock::now();
+                continue;
+            }
+            retries = 0;
+            lastAck = std::chrono::steady_clock::now();
+            if (linkTest != NULL)
+                linkTest->ackLatenciesMs.push_back(elapsedMs(flight.sent));
+            else
+                recordAck(flight.workload, static_cast<double>(std::chrono::duration_cast<std::chrono::microseconds>(lastAck - start).count()));
+            acknowledgeBatch(queue);
+            oldest = (oldest + 1) % flights.size();
+            inFlight--;
+        }
+    }
+
+    /**
+    * \brief The oldest batch in flight is acknowledged: checkpoint it and release it from [queue].
+    */
+    void acknowledgeBatch(BatchQueue &queue) {
+        m_checkpoint.add(queue.peek(0), queue.batchSize());
+        if (m_checkpointWriter.isRunning())
+            m_checkpointWriter.post(m_checkpoint);
+        queue.commitRead();
+    }
+
+    /**
+    * \brief Train the pacer. Only the streaming thread writes it and reads it without the lock, getAckPacer() copies it under the lock.
+    */
+    void recordAck(const BatchWorkload &workload, double latencyUs) {
+        std::lock_guard<std::mutex> lock(m_stateMutex);
+        m_pacer.record(workload, latencyUs);
+    }
+
+    static double elapsedMs(std::chrono::steady_clock::time_point since) {
+        return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - since).count();
+    }
+
+    /**
+    * \brief Moves in a batch, not counting the empty packets padding the last one.
+    */
+    static size_t countMoves(const uint8_t* batch, size_t batchSize) {
+        size_t moves = 0;
+        for (size_t i = 3; i < batchSize; i += 4)
+            moves += batch[i] != 0;
+        return moves;
+    }
+
+    /**
+    * \brief How long to wait for the acknowledgement of the batch of [workload]: the ack timeout,
+    *   or with setAdaptiveAckDeadline() a few times its predicted processing time once the pacer is reliable.
+    */
+    int getAckDeadlineMs(const BatchWorkload &workload) {
+        double predictedUs = m_adaptiveDeadline ? m_pacer.predictUs(workload) : -1;
+        if (predictedUs < 0)
+            return m_ackTimeoutMs;
+        int deadlineMs = static_cast<int>(predictedUs * LASER_PRINTER_ACK_DEADLINE_FACTOR / 1000.0);
+        return (std::min)(m_ackTimeoutMs.load(), (std::max)(LASER_PRINTER_MIN_ACK_DEADLINE_MS, deadlineMs));
+    }
+
+    /**
+    * \brief Wait for the "B1" of a batch completed during a resync: its first bytes may be those of the batch of [workload].
+    *   A few times its predicted processing time when the pacer is reliable, LASER_PRINTER_ABORT_TIMEOUT_MS otherwise.
+    */
+    int getResyncStepMs(const BatchWorkload &workload) {
+        double predictedUs = m_pacer.predictUs(workload);
+        if (predictedUs < 0)
+            return LASER_PRINTER_ABORT_TIMEOUT_MS;
+        return (std::max)(LASER_PRINTER_RESYNC_STEP_MS, static_cast<int>(predictedUs * LASER_PRINTER_ACK_DEADLINE_FACTOR / 1000.0));
+    }
+
+    /**
+    * \brief Sleep until shortly before the batch of [workload] started at [start] is predicted to be acknowledged,
+    *   so the ack wait starts when the answer is due instead of right after the send.
+    *   The margin absorbs prediction errors, the ack wait itself is still event driven.
+    */
+    void waitForPredictedAck(const BatchWorkload &workload, std::chrono::steady_clock::time_point start) {
+        if (!m_adaptivePacing)
+            return;
+        double predictedUs = m_pacer.predictUs(workload);
+        if (predictedUs <= 0)
+            return;
+        double sleepUs = (std::min)(predictedUs * (1.0 - LASER_PRINTER_PACING_MARGIN) - 1000.0, m_ackTimeoutMs * 1000.0);
+        if (sleepUs <= 0)
+            return;
+        std::chrono::steady_clock::time_point wakeUp = start + std::chrono::microseconds(static_cast<long long>(sleepUs));
+        //In slices so an abort does not wait for a long burn
+        while (!isCancelled() && std::chrono::steady_clock::now() < wakeUp)
+            std::this_thread::sleep_until((std::min)(wakeUp, std::chrono::steady_clock::now() + std::chrono::milliseconds(LASER_PRINTER_CONTROL_POLL_MS)));
+    }
+
+    /**
+    * \brief Block on the transport until [token] is received or [timeoutMs] elapsed.
+    *   Returns as soon as the token arrives, the transport receive ring finds tokens split across two reads
+    *   and keeps the bytes following the token for the next wait.
+    *   An empty [token] accepts any answer, NULL waits for the full timeout and always succeeds.
+    */
+    bool waitForResponse(const char* token, int timeoutMs) {
+        return waitForToken(m_transport, token, timeoutMs, NULL);
+    }
+
+    /**
+    * \brief waitForResponse() on any transport.
+    * \param cancel: when set, the wait is given up within 50 ms and returns false.
+    * \param otherCancel: second flag with the same effect, NULL if unused.
+    */
+    static bool waitForToken(LaserTransport* transport, const char* token, int timeoutMs, const std::atomic<bool>* cancel, const std::atomic<bool>* otherCancel = NULL) {
+        std::chrono::steady_clock::time_point deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(timeoutMs);
+        const char* tokens[1] = { token };
+        size_t tokenCount = token != NULL ? 1 : 0;
+        while (true) {
+            int remaining = static_cast<int>(std::chrono::duration_cast<std::chrono::milliseconds>(deadline - std::chrono::steady_clock::now()).count());
+            if (remaining < 0)
+                remaining = 0;
+            if ((cancel != NULL && *cancel) || (otherCancel != NULL && *otherCancel))
+                return false;
+            if (transport->waitFor(tokens, tokenCount, cancel != NULL ? (std::min)(remaining, 50) : remaining) >= 0)
+                return true;
+            if (remaining == 0 || cancel == NULL)
+                return token == NULL;
+        }
+    }
+
+    LaserTransport* m_transport;
+    std::atomic<bool> m_connected;
+    std::atomic<unsigned int> m_printOriginX;
+    std::atomic<unsigned int> m_printOriginY;
+    std::atomic<bool> m_printing;
+    std::atomic<int> m_ackTimeoutMs;                        // settings: atomic, they are read by the job while it prints
+    std::atomic<int> m_batchWindow;
+    std::atomic<bool> m_adaptivePacing;
+    std::atomic<bool> m_adaptiveDeadline;
+    AckPacer m_pacer;
+    std::atomic<LaserPrinterRecovery> m_recovery;
+    std::atomic<int> m_maxRetries;
+    unsigned int m_jobOriginX;
+    unsigned int m_jobOriginY;
+    bool m_jobFan;
+    bool m_endPending;          // "$33" sent and its "F22" not received yet
+    int m_lastError;
+    std::string m_lastErrorMessage;
+    std::string m_checkpointPath;
+    std::string m_portName;
+    std::mutex m_stateMutex;                                // guards the error, the checkpoint path, the port name and the pacer updates, never held across I/O
+    JobCheckpoint m_checkpoint;
+    JobCheckpointWriter m_checkpointWriter;
+    std::atomic<bool> m_pauseRequested;
+    std::atomic<bool> m_abortRequested;
+    std::recursive_mutex m_mutex;                           // serializes the use of the link
+    LaserPrintJobState* m_job;                              // submitted job being printed, NULL for a blocking call
+    std::thread m_worker;
+    std::mutex m_workerMutex;
+    std::condition_variable m_workerWakeUp;
+    std::deque<LaserPrinterPendingJob> m_pendingJobs;
+    std::shared_ptr<LaserPrintJobState> m_runningJob;
+    bool m_stopWorker;
+    std::atomic<int> m_activeJobs;                          // submitted jobs not finished yet
 
 };
 
@@ -0,0 +1,306 @@
+#ifndef LaserPrinterFarm_hpp
+#define LaserPrinterFarm_hpp
+
+#include <string>
+#include <vector>
+#include <deque>
+#include <memory>
+#include <functional>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+
+#include "LaserPrinter.hpp"
+#include "LaserPrintJob.hpp"
+#include "SVGParser.hpp"
+
+#define LASER_PRINTER_FARM_RECONNECT_CHECK_MS 1000 // how often a machine without printer checks it again
+
+/**
+* \brief A job of the farm, ready to print once planned.
+*/
+struct LaserFarmJob {
+    std::shared_ptr<LaserPrintJobState> state;
+    std::shared_ptr<const std::vector<uint8_t> > pixels;                // set for an image
+    std::shared_ptr<const PrintProgram> program;                        // set for a shape, planned on the pool, or a compiled program
+    int width;
+    int height;
+    bool fan;
+    unsigned int originX;
+    unsigned int originY;
+};
+
+/**
+* \brief Drives several printers from one process: jobs go to a shared queue and each one is printed by the next idle printer.
+*   Every printer streams from its own machine thread, the CPU stages (SVG parsing, path reordering, interpolation
+*   and encoding, see LaserPrinter::compileShape()) run on a shared planner pool: the machine threads only stream batches.
+*   Idle threads block on condition variables and the streaming loops wait on the links, so the host stays quiet
+*   however many printers are streaming.
+*/
+class LaserPrinterFarm {
+public:
+    /**
+    * \param plannerThreads: size of the planner pool, 0 for one per hardware thread.
+    */
+    LaserPrinterFarm(size_t plannerThreads = 0)
+        : m_stopping(false)
+        , m_printOriginX(0)
+        , m_printOriginY(0)
+    {
+        if (plannerThreads == 0)
+            plannerThreads = (std::max)(1u, std::thread::hardware_concurrency());
+        for (size_t i = 0; i < plannerThreads; i++)
+            m_planners.push_back(std::thread([this]() { runPlanner(); }));
+    }
+
+    /**
+    * \brief Jobs that did not complete are cancelled, the printers are closed.
+    */
+    ~LaserPrinterFarm() {
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_stopping = true;
+            for (size_t i = 0; i < m_planQueue.size(); i++)
+                m_planQueue[i].job.state->cancelled = true;
+            for (size_t i = 0; i < m_readyJobs.size(); i++)
+                m_readyJobs[i].state->cancelled = true;
+            for (size_t i = 0; i < m_machines.size(); i++) {
+                if (m_machines[i]->running)
+                    m_machines[i]->running->cancelled = true;
+            }
+            m_planWakeUp.notify_all();
+            m_jobWakeUp.notify_all();
+        }
+        for (size_t i = 0; i < m_planners.size(); i++)
+            m_planners[i].join();
+        for (size_t i = 0; i < m_machines.size(); i++) {
+            m_machines[i]->thread.join();
+            delete m_machines[i]->printer;
+            delete m_machines[i];
+        }
+        //Jobs cancelled in the queues never reached a machine
+        for (size_t i = 0; i < m_planQueue.size(); i++)
+            m_planQueue[i].job.state->finish(LASER_PRINTER_ABORTED, "cancelled before it started");
+        for (size_t i = 0; i < m_readyJobs.size(); i++)
+            m_readyJobs[i].state->finish(LASER_PRINTER_ABORTED, "cancelled before it started");
+    }
+
+    /**
+    * \brief Add a printer to the farm, it starts taking jobs right away. Takes ownership of [printer].
+    * \return the index of the printer
+    */
+    size_t addPrinter(LaserPrinter* printer) {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        Machine* machine = new Machine();
+        machine->printer = printer;
+        machine->busy = false;
+        machine->thread = std::thread([this, machine]() { runMachine(machine); });
+        m_machines.push_back(machine);
+        return m_machines.size() - 1;
+    }
+
+    size_t getPrinterCount() {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        return m_machines.size();
+    }
+
+    /**
+    * \brief Printer [index], to configure it. Its own print calls wait for the farm job it is printing.
+    */
+    LaserPrinter* getPrinter(size_t index) {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        return m_machines.at(index)->printer;
+    }
+
+    /**
+    * \brief Printers printing a job at the moment.
+    */
+    size_t getBusyCount() {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        size_t busy = 0;
+        for (size_t i = 0; i < m_machines.size(); i++)
+            busy += m_machines[i]->busy ? 1 : 0;
+        return busy;
+    }
+
+    /**
+    * \brief Jobs planned and waiting for an idle printer.
+    */
+    size_t getQueuedCount() {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        return m_readyJobs.size();
+    }
+
+    /**
+    * \brief Origin of the jobs submitted from now on, on whichever printer prints them.
+    */
+    void setPrintOrigin(unsigned int x, unsigned int y) {
+        m_printOriginX = (std::min)(x, static_cast<unsigned int>(LASER_PRINTER_RESOLUTION_WIDTH));
+        m_printOriginY = (std::min)(y, static_cast<unsigned int>(LASER_PRINTER_RESOLUTION_HEIGHT));
+    }
+
+    /**
+    * \brief Plan [segments] on the planner pool, then queue them for the next idle printer. The segments are copied.
+    */
+    LaserPrintJob submitShape(const std::vector<LaserPrinterSegment> &segments, int width, int height, bool enableFan) {
+        std::shared_ptr<const std::vector<LaserPrinterSegment> > shape = std::make_shared<std::vector<LaserPrinterSegment> >(segments);
+        return submitShape([shape, width, height](int &planWidth, int &planHeight) {
+            planWidth = width;
+            planHeight = height;
+            return *shape;
+        }, enableFan);
+    }
+
+    /**
+    * \brief Queue [image] for the next idle printer. The image is copied.
+    */
+    LaserPrintJob submitImage(const uint8_t* image, int width, int height, bool enableFan) {
+        LaserFarmJob job = newJob(width, height, enableFan);
+        job.pixels = std::make_shared<std::vector<uint8_t> >(image, image + width * height);
+        dispatch(job);
+        return LaserPrintJob(job.state);
+    }
+
+    /**
+    * \brief Queue [program] for the next idle printer. The program is shared, not copied.
+    */
+    LaserPrintJob submitProgram(std::shared_ptr<const PrintProgram> program, bool enableFan) {
+        LaserFarmJob job = newJob(program->width(), program->height(), enableFan);
+        job.program = program;
+        dispatch(job);
+        return LaserPrintJob(job.state);
+    }
+
+    /**
+    * \brief Run [planner] then plan its segments on the planner pool, then queue them for the next idle printer.
+    */
+    LaserPrintJob submitShape(LaserShapePlanner planner, bool enableFan) {
+        LaserFarmJob job = newJob(0, 0, enableFan);
+        std::lock_guard<std::mutex> lock(m_mutex);
+        PendingPlan plan;
+        plan.job = job;
+        plan.planner = planner;
+        m_planQueue.push_back(plan);
+        m_planWakeUp.notify_one();
+        return LaserPrintJob(job.state);
+    }
+
+    /**
+    * \brief Parse [filePath] on the planner pool, then queue it for the next idle printer.
+    */
+    LaserPrintJob submitSVG(const std::string &filePath, bool enableFan) {
+        return submitShape([filePath](int &width, int &height) {
+            return SVGParser::getSegments(filePath, width, height);
+        }, enableFan);
+    }
+
+private:
+    /**
+    * \brief A printer and the thread streaming its jobs.
+    */
+    struct Machine {
+        LaserPrinter* printer;
+        std::thread thread;
+        bool busy;
+        std::shared_ptr<LaserPrintJobState> running;
+    };
+
+    struct PendingPlan {
+        LaserFarmJob job;
+        LaserShapePlanner planner;
+    };
+
+    LaserFarmJob newJob(int width, int height, bool enableFan) {
+        LaserFarmJob job;
+        job.state = std::make_shared<LaserPrintJobState>();
+        job.width = width;
+        job.height = height;
+        job.fan = enableFan;
+        job.originX = m_printOriginX;
+        job.originY = m_printOriginY;
+        return job;
+    }
+
+    void dispatch(const LaserFarmJob &job) {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_readyJobs.push_back(job);
+        m_jobWakeUp.notify_one();
+    }
+
+    /**
+    * \brief Planner pool thread: run the planners in submission order, compile their segments and queue the planned jobs.
+    */
+    void runPlanner() {
+        while (true) {
+            PendingPlan plan;
+            {
+                std::unique_lock<std::mutex> lock(m_mutex);
+                m_planWakeUp.wait(lock, [this]() { return m_stopping || !m_planQueue.empty(); });
+                if (m_stopping)
+                    return;
+                plan = m_planQueue.front();
+                m_planQueue.pop_front();
+            }
+            if (plan.job.state->cancelled) {
+                plan.job.state->finish(LASER_PRINTER_ABORTED, "cancelled before it started");
+                continue;
+            }
+            LaserFarmJob job = plan.job;
+            std::vector<LaserPrinterSegment> segments = plan.planner(job.width, job.height);
+            if (segments.empty()) {
+                plan.job.state->finish(LASER_PRINTER_PLANNING_ERROR, "the job has nothing to print");
+                continue;
+            }
+            job.program = LaserPrinter::compileShape(segments, job.width, job.height);
+            std::lock_guard<std::mutex> lock(m_mutex);
+            if (m_stopping) {
+                m_readyJobs.push_back(job);  // finished by the destructor
+                return;
+            }
+            m_readyJobs.push_back(job);
+            m_jobWakeUp.notify_one();
+        }
+    }
+
+    /**
+    * \brief Machine thread: take the next job whenever the printer is idle and connected, and stream it.
+    */
+    void runMachine(Machine* machine) {
+        while (true) {
+            LaserFarmJob job;
+            {
+                std::unique_lock<std::mutex> lock(m_mutex);
+                while (!m_stopping && (m_readyJobs.empty() || !machine->printer->isConnected()))
+                    m_jobWakeUp.wait_for(lock, std::chrono::milliseconds(LASER_PRINTER_FARM_RECONNECT_CHECK_MS));
+                if (m_stopping)
+                    return;
+                job = m_readyJobs.front();
+                m_readyJobs.pop_front();
+                machine->busy = true;
+                machine->running = job.state;
+            }
+            LaserPrinter* printer = machine->printer;
+            if (job.program)
+                printer->execute(job.state.get(), printer->programJob(job.program, job.originX, job.originY, job.fan));
+            else
+                printer->execute(job.state.get(), printer->imageJob(job.pixels, job.originX, job.originY, job.width, job.height, job.fan));
+            std::lock_guard<std::mutex> lock(m_mutex);
+            machine->busy = false;
+            machine->running.reset();
+        }
+    }
+
+    std::mutex m_mutex;
+    std::condition_variable m_planWakeUp;
+    std::condition_variable m_jobWakeUp;
+    std::deque<PendingPlan> m_planQueue;
+    std::deque<LaserFarmJob> m_readyJobs;
+    std::vector<std::thread> m_planners;
+    std::vector<Machine*> m_machines;
+    bool m_stopping;
+    std::atomic<unsigned int> m_printOriginX;
+    std::atomic<unsigned int> m_printOriginY;
+};
+
+#endif // LaserPrinterFarm_hpp
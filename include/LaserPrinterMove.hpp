@@ -0,0 +1,159 @@
+#ifndef LaserPrinterMove_hpp
+#define LaserPrinterMove_hpp
+
+#include <vector>
+#include <cmath>
+#include <stdint.h>
+
+#define LASER_PRINTER_RESOLUTION_WIDTH 1024
+#define LASER_PRINTER_RESOLUTION_HEIGHT 1024
+#define LASER_PRINTER_MOVE_BUFFER_LENGHT 256
+
+/**
+* \brief Whether a job of [width] x [height] at [originX] [originY] is in the printing area.
+*   Checked without overflow: the origin may come from a file or another process.
+*/
+inline bool isInPrintArea(unsigned int originX, unsigned int originY, int width, int height) {
+    return originX <= LASER_PRINTER_RESOLUTION_WIDTH && originY <= LASER_PRINTER_RESOLUTION_HEIGHT
+        && width >= 0 && static_cast<unsigned int>(width) <= LASER_PRINTER_RESOLUTION_WIDTH - originX
+        && height >= 0 && static_cast<unsigned int>(height) <= LASER_PRINTER_RESOLUTION_HEIGHT - originY;
+}
+
+/**
+* Print packet: {(A)0x00, (B)0x00, (C)0x00, (D)0x00}
+*   A: 8 low signicative bits for the X position
+*   B:
+*    - 4 first bits: high signicative bits for the X position
+*    - 4 last  bits: high signicative bits for the Y position
+*   C: 8 low signicative bits for the Y position
+*   D: laser burn duration at the given position
+*   Print packets should be sent in batches of 256 packets.
+*   If less than 256 packets need to be sent, fill with packets filled with 0x00.
+*
+*  x: between 0 and 1023
+*  y: between 0 and 1023
+*  duration: between 0 and 255
+*/
+struct LaserPrinterMove {
+    unsigned int x;
+    unsigned int y;
+    uint8_t duration;
+
+    LaserPrinterMove() {
+        x = 0;
+        y = 0;
+        duration = 0;
+    }
+
+    LaserPrinterMove(unsigned int x, unsigned y, uint8_t duration) {
+        this->x = x;
+        this->y = y;
+        this->duration = duration;
+    }
+
+    void fromCommand(const uint8_t* command) {
+        x = command[0] + 16 * (command[1] & 0xF0);
+        y = command[2] + 256 * (command[1] & 0x0F);
+        duration = command[3];
+    }
+
+    void toCommand(uint8_t* command) const {
+        command[0] = x & 0x0FF;
+        command[1] = (x & 0xF00) / 16 + (y & 0xF00) / 255;
+        command[2] = y & 0x0FF;
+        command[3] = duration;
+    }
+};
+
+/**
+* \brief A move held as its 4 bytes print packet, see above. Encoded at compile time for constant moves.
+*   The bytes are in wire order whatever the host endianness: an array of PackedMove is a batch ready to send.
+*/
+struct PackedMove {
+    uint8_t packet[4];
+
+    constexpr PackedMove()
+        : packet{ 0, 0, 0, 0 }
+    {
+    }
+
+    constexpr PackedMove(unsigned int x, unsigned int y, uint8_t duration)
+        : packet{ static_cast<uint8_t>(x & 0xFF), static_cast<uint8_t>(((x >> 4) & 0xF0) | ((y >> 8) & 0x0F)), static_cast<uint8_t>(y & 0xFF), duration }
+    {
+    }
+
+    constexpr unsigned int x() const {
+        return packet[0] | ((packet[1] & 0xF0) << 4);
+    }
+
+    constexpr unsigned int y() const {
+        return packet[2] | ((packet[1] & 0x0F) << 8);
+    }
+
+    constexpr uint8_t duration() const {
+        return packet[3];
+    }
+};
+
+static_assert(sizeof(PackedMove) == 4, "PackedMove must be a print packet");
+static_assert(PackedMove(0xABC, 0x3DE, 7).x() == 0xABC && PackedMove(0xABC, 0x3DE, 7).y() == 0x3DE, "PackedMove encoding");
+
+struct LaserPrinterSegment {
+    LaserPrinterSegment() {}
+    LaserPrinterSegment(unsigned int _startX
+        , unsigned int _startY
+        , unsigned int _endX
+        , unsigned int _endY
+        , uint8_t _duration)
+    {
+        startX = _startX;
+        startY = _startY;
+        endX = _endX;
+        endY = _endY;
+        duration = _duration;
+    }
+    unsigned int startX = 0;
+    unsigned int startY = 0;
+    unsigned int endX = 0;
+    unsigned int endY = 0;
+    uint8_t duration;
+
+    void reverse() {
+        unsigned int _startX = startX;
+        unsigned int _startY = startY;
+        startX = endX;
+        startY = endY;
+        endX = _startX;
+        endY = _startY;
+    }
+
+    std::vector<LaserPrinterMove> getInterpolation() const {
+        std::vector<LaserPrinterMove> out;
+        interpolate(out);
+        return out;
+    }
+
+    /**
+    * \brief Append the moves of the segment to [out], a std::vector<LaserPrinterMove> or a MoveBuffer.
+    */
+    template <class MoveContainer>
+    void interpolate(MoveContainer &out) const {
+        float distanceX = (float)endX - (float)startX;
+        float distanceY = (float)endY - (float)startY;
+        float distance = std::sqrt(distanceX * distanceX + distanceY * distanceY);
+        out.push_back(LaserPrinterMove(startX, startY, duration));
+        if (distance > 1) {
+            for (float i = 1; i < distance; i+=1) {
+                float step = i / distance;
+                out.push_back(LaserPrinterMove(lerp(startX, endX, step), lerp(startY, endY, step), duration));
+            }
+        }
+        out.push_back(LaserPrinterMove(endX, endY, duration));
+    }
+private:
+    float lerp(float a, float b, float f) const {
+        return a + f * (b - a);
+    }
+};
+
+#endif // LaserPrinterMove_hpp
@@ -0,0 +1,489 @@
+#ifndef LaserTransport_hpp
+#define LaserTransport_hpp
+
+#include <string>
+#include <deque>
+#include <vector>
+#include <fstream>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <chrono>
+#include <algorithm>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "SerialPort.hpp"
+#include "ReceiveRing.hpp"
+#include "LaserPrinterMove.hpp"
+#include "MoveBuffer.hpp"
+
+#ifndef _WIN32
+    #include <fcntl.h>
+    #include <termios.h>
+    #include <unistd.h>
+    #include <poll.h>
+    #include <errno.h>
+#endif
+
+#ifdef WITH_OPENCV
+    #include "opencv2/opencv.hpp"
+#endif
+
+/**
+* \brief Byte link between LaserPrinter and a printer, real or not.
+*   Every message given to write() is either a "$" command or a full batch of print packets.
+*/
+class LaserTransport {
+public:
+    virtual ~LaserTransport() {}
+
+    virtual bool isOpen() = 0;
+
+    virtual bool write(const void* data, size_t length) = 0;
+
+    /**
+    * \brief Gather write of one message made of [count] buffers.
+    *   Streams send the buffers without copying, message based transports join them first.
+    */
+    virtual bool writev(const SerialBuffer* buffers, size_t count) {
+        if (count == 1)
+            return write(buffers[0].data, buffers[0].length);
+        std::string message;
+        for (size_t i = 0; i < count; i++)
+            message.append((const char*)buffers[i].data, buffers[i].length);
+        return write(message.c_str(), message.length());
+    }
+
+    bool write(const std::string &message) {
+        return write(message.c_str(), message.length());
+    }
+
+    /**
+    * \brief Low level read of at most [capacity] bytes, waiting up to [timeoutMs] for the first one.
+    */
+    virtual size_t receive(char* buffer, size_t capacity, int timeoutMs) = 0;
+
+    /**
+    * \brief Return the bytes received so far, waiting up to [timeoutMs] for the first one.
+    */
+    virtual std::string read(int timeoutMs = 0) {
+        size_t available;
+        char* destination = m_ring.writePointer(available);
+        m_ring.commitWrite(receive(destination, available, m_ring.size() > 0 ? 0 : timeoutMs));
+        std::string out;
+        m_ring.take(out);
+        return out;
+    }
+
+    /**
+    * \brief Wait until one of [tokens] is received, see ReceiveRing::match().
+    * \return the index of the matched token, -1 on timeout.
+    */
+    virtual int waitFor(const char* const* tokens, size_t tokenCount, int timeoutMs) {
+        return m_ring.waitFor(tokens, tokenCount, timeoutMs, [this](char* buffer, size_t capacity, int timeout) {
+            return receive(buffer, capacity, timeout);
+        });
+    }
+
+    /**
+    * \brief Human readable name of the link (port name, file path...)
+    */
+    virtual std::string name() = 0;
+
+    /**
+    * \brief Whether a real printer may be on the other end, as opposed to an emulator, a capture or a replay.
+    */
+    virtual bool isHardware() {
+        return false;
+    }
+
+private:
+    ReceiveRing m_ring;
+};
+
+/**
+* \brief Real printer on a serial port.
+*/
+class SerialTransport : public LaserTransport {
+public:
+    SerialTransport(std::string portName)
+        : m_portName(portName)
+        , m_serial(portName)
+    {
+    }
+
+    bool isOpen() {
+        return m_serial.isConnected();
+    }
+
+    using LaserTransport::write;
+
+    bool write(const void* data, size_t length) {
+        return m_serial.write(data, length);
+    }
+
+    bool writev(const SerialBuffer* buffers, size_t count) {
+        return m_serial.writev(buffers, count);
+    }
+
+    size_t receive(char* buffer, size_t capacity, int timeoutMs) {
+        return m_serial.receive(buffer, capacity, timeoutMs);
+    }
+
+    std::string read(int timeoutMs = 0) {
+        return m_serial.read(timeoutMs);
+    }
+
+    int waitFor(const char* const* tokens, size_t tokenCount, int timeoutMs) {
+        return m_serial.waitFor(tokens, tokenCount, timeoutMs);
+    }
+
+    std::string name() {
+        return m_portName;
+    }
+
+    bool isHardware() {
+        return true;
+    }
+
+private:
+    std::string m_portName;
+    SerialPort m_serial;
+};
+
+#ifndef _WIN32
+/**
+* \brief Pseudo-terminal whose slave side is left for another process to open,
+*   e.g. a firmware emulator or a bridge to a remote printer (socat).
+*   The driver talks through the master side.
+*/
+class PtyTransport : public LaserTransport {
+public:
+    PtyTransport()
+        : m_master(-1)
+        , m_slave(-1)
+    {
+        m_master = posix_openpt(O_RDWR | O_NOCTTY);
+        if (m_master < 0)
+            return;
+        if (grantpt(m_master) != 0 || unlockpt(m_master) != 0) {
+            close(m_master);
+            m_master = -1;
+            return;
+        }
+        m_slavePath = ptsname(m_master);
+        //Keep the slave side open in raw mode so the master never sees a hang-up between peers
+        m_slave = open(m_slavePath.c_str(), O_RDWR | O_NOCTTY);
+        if (m_slave >= 0) {
+            struct termios tty;
+            if (tcgetattr(m_slave, &tty) == 0) {
+                cfmakeraw(&tty);
+                tcsetattr(m_slave, TCSANOW, &tty);
+            }
+        }
+        fcntl(m_master, F_SETFL, fcntl(m_master, F_GETFL) | O_NONBLOCK);
+    }
+
+    ~PtyTransport() {
+        if (m_slave >= 0)
+            close(m_slave);
+        if (m_master >= 0)
+            close(m_master);
+    }
+
+    /**
+    * \brief Device path to hand to the peer, like /dev/pts/3
+    */
+    std::string slavePath() {
+        return m_slavePath;
+    }
+
+    bool isOpen() {
+        return m_master >= 0;
+    }
+
+    using LaserTransport::write;
+
+    bool write(const void* data, size_t length) {
+        size_t sent = 0;
+        while (sent < length) {
+            ssize_t n = ::write(m_master, (const char*)data + sent, length - sent);
+            if (n > 0) {
+                sent += n;
+            }
+            else if (n < 0 && (errno == EAGAIN || errno == EINTR)) {
+                struct pollfd pfd;
+                pfd.fd = m_master;
+                pfd.events = POLLOUT;
+                pfd.revents = 0;
+                if (poll(&pfd, 1, 1000) <= 0)
+                    return false;
+            }
+            else {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    size_t receive(char* buffer, size_t capacity, int timeoutMs) {
+        struct pollfd pfd;
+        pfd.fd = m_master;
+        pfd.events = POLLIN;
+        pfd.revents = 0;
+        if (poll(&pfd, 1, timeoutMs) <= 0 || !(pfd.revents & POLLIN))
+            return 0;
+        ssize_t n = ::read(m_master, buffer, capacity);
+        return n > 0 ? n : 0;
+    }
+
+    std::string name() {
+        return m_slavePath;
+    }
+
+private:
+    int m_master;
+    int m_slave;
+    std::string m_slavePath;
+};
+#endif
+
+/**
+* \brief In-memory link to a device running in the same process.
+*   The driver uses write()/read(), the device uses deviceRead()/deviceWrite().
+*   Message boundaries of the driver writes are kept.
+*/
+class LoopbackTransport : public LaserTransport {
+public:
+    LoopbackTransport()
+        : m_closed(false)
+    {
+    }
+
+    bool isOpen() {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        return !m_closed;
+    }
+
+    using LaserTransport::write;
+
+    bool write(const void* data, size_t length) {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        if (m_closed)
+            return false;
+        m_toDevice.push_back(std::string((const char*)data, length));
+        m_deviceCondition.notify_one();
+        return true;
+    }
+
+    size_t receive(char* buffer, size_t capacity, int timeoutMs) {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        m_driverCondition.wait_for(lock, std::chrono::milliseconds(timeoutMs), [this]() { return !m_toDriver.empty() || m_closed; });
+        size_t length = (std::min)(capacity, m_toDriver.length());
+        memcpy(buffer, m_toDriver.c_str(), length);
+        m_toDriver.erase(0, length);
+        return length;
+    }
+
+    std::string name() {
+        return "loopback";
+    }
+
+    /**
+    * \brief Device side: pop the next message written by the driver. False on timeout or once closed.
+    */
+    bool deviceRead(std::string &message, int timeoutMs) {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        m_deviceCondition.wait_for(lock, std::chrono::milliseconds(timeoutMs), [this]() { return !m_toDevice.empty() || m_closed; });
+        if (m_toDevice.empty())
+            return false;
+        message.swap(m_toDevice.front());
+        m_toDevice.pop_front();
+        return true;
+    }
+
+    /**
+    * \brief Device side: send bytes to the driver.
+    */
+    void deviceWrite(const std::string &message) {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_toDriver += message;
+        m_driverCondition.notify_one();
+    }
+
+    void close() {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_closed = true;
+        m_deviceCondition.notify_all();
+        m_driverCondition.notify_all();
+    }
+
+private:
+    std::mutex m_mutex;
+    std::condition_variable m_deviceCondition;
+    std::condition_variable m_driverCondition;
+    std::deque<std::string> m_toDevice;
+    std::string m_toDriver;
+    bool m_closed;
+};
+
+/**
+* \brief Base of the transports that stand in for the firmware in the same thread:
+*   every write is answered immediately the way the printer would ("connect", "ok", "B1", "F22").
+*/
+class EmulatedTransport : public LaserTransport {
+public:
+    bool isOpen() {
+        return true;
+    }
+
+    using LaserTransport::write;
+
+    bool write(const void* data, size_t length) {
+        const char* message = (const char*)data;
+        consume(message, length);
+        if (length == LASER_PRINTER_MOVE_BUFFER_LENGHT * 4)
+            m_pending += "B1";
+        else if (isCommand(message, length, "$40"))
+            m_pending += "connect";
+        else if (isCommand(message, length, "$33"))
+            m_pending += "F22";
+        else if (isCommand(message, length, "$20") || isCommand(message, length, "$25") || isCommand(message, length, "$30") || isCommand(message, length, "$42"))
+            m_pending += "ok";
+        return true;
+    }
+
+    size_t receive(char* buffer, size_t capacity, int timeoutMs) {
+        //Replies are immediate: if nothing is pending, nothing will come
+        if (m_pending.empty()) {
+            if (timeoutMs > 0)
+                std::this_thread::sleep_for(std::chrono::milliseconds(timeoutMs));
+            return 0;
+        }
+        size_t length = (std::min)(capacity, m_pending.length());
+        memcpy(buffer, m_pending.c_str(), length);
+        m_pending.erase(0, length);
+        return length;
+    }
+
+protected:
+    virtual void consume(const char* message, size_t length) = 0;
+
+    static bool isCommand(const char* message, size_t length, const char* code) {
+        size_t codeLength = strlen(code);
+        return length >= codeLength && memcmp(message, code, codeLength) == 0;
+    }
+
+private:
+    std::string m_pending;
+};
+
+/**
+* \brief Record the exact byte stream sent to the printer into a file.
+*/
+class CaptureTransport : public EmulatedTransport {
+public:
+    CaptureTransport(std::string filePath)
+        : m_filePath(filePath)
+        , m_file(filePath.c_str(), std::ios::binary | std::ios::trunc)
+    {
+    }
+
+    bool isOpen() {
+        return m_file.is_open();
+    }
+
+    std::string name() {
+        return m_filePath;
+    }
+
+protected:
+    void consume(const char* message, size_t length) {
+        m_file.write(message, length);
+        m_file.flush();
+    }
+
+private:
+    std::string m_filePath;
+    std::ofstream m_file;
+};
+
+/**
+* \brief Draw the print on a 1024x1024 canvas instead of burning it.
+*   The canvas is shown in an OpenCV window when available, headless otherwise.
+*/
+class SimulatorTransport : public EmulatedTransport {
+public:
+    SimulatorTransport(bool display = true)
+        : m_canvas(LASER_PRINTER_RESOLUTION_WIDTH * LASER_PRINTER_RESOLUTION_HEIGHT, 0)
+        , m_display(display)
+        , m_originX(0)
+        , m_originY(0)
+        , m_batchCount(0)
+    {
+    }
+
+    std::string name() {
+        return "simulating";
+    }
+
+    /**
+    * \brief Row-major 8 bits canvas, a pixel holds the last burn duration printed at that position.
+    */
+    const std::vector<uint8_t> &canvas() {
+        return m_canvas;
+    }
+
+    size_t batchCount() {
+        return m_batchCount;
+    }
+
+protected:
+    void consume(const char* message, size_t length) {
+        if (length == LASER_PRINTER_MOVE_BUFFER_LENGHT * 4) {
+            drawBatch((const uint8_t*)message);
+            m_batchCount++;
+        }
+        else if (isCommand(message, length, "$30 P")) {
+            //Print origin of the job: "$30 P<x> <y> P<fan>"
+            std::string command(message, length);
+            m_originX = atoi(command.c_str() + 5);
+            size_t space = command.find(' ', 5);
+            if (space != std::string::npos)
+                m_originY = atoi(command.c_str() + space + 1);
+        }
+    }
+
+private:
+    void drawBatch(const uint8_t* buffer) {
+        m_batch.clear();
+        m_batch.appendPackets(buffer, LASER_PRINTER_MOVE_BUFFER_LENGHT);
+        for (size_t i = 0; i < m_batch.size(); i++) {
+            int x = m_originX + m_batch.x()[i];
+            int y = m_originY + m_batch.y()[i];
+            if (x >= LASER_PRINTER_RESOLUTION_WIDTH) x = LASER_PRINTER_RESOLUTION_WIDTH-1;
+            if (y >= LASER_PRINTER_RESOLUTION_HEIGHT) y = LASER_PRINTER_RESOLUTION_HEIGHT-1;
+            if (x < 0) x = 0;
+            if (y < 0) y = 0;
+            m_canvas[y * LASER_PRINTER_RESOLUTION_WIDTH + x] = m_batch.duration()[i];
+        }
+#ifdef WITH_OPENCV
+        if (m_display) {
+            cv::Mat preview(cv::Size(LASER_PRINTER_RESOLUTION_WIDTH, LASER_PRINTER_RESOLUTION_HEIGHT), CV_8UC1, &m_canvas[0]);
+            cv::imshow("preview", preview);
+            cv::waitKey(1);
+        }
+#endif
+    }
+
+    std::vector<uint8_t> m_canvas;
+    MoveBuffer m_batch;
+    bool m_display;
+    int m_originX;
+    int m_originY;
+    size_t m_batchCount;
+};
+
+#endif // LaserTransport_hpp
@@ -0,0 +1,153 @@
+#ifndef MoveBuffer_hpp
+#define MoveBuffer_hpp
+
+#include <vector>
+#include <algorithm>
+#include <stdint.h>
+#include <string.h>
+
+#include "LaserPrinterMove.hpp"
+#include "MovePacketCodec.hpp"
+
+/**
+* \brief Moves stored as a structure of arrays (x, y, duration: 5 bytes a move), allocated by whole batches of
+*   LASER_PRINTER_MOVE_BUFFER_LENGHT moves. The slots after the last move are kept empty, so batch [n] always starts at
+*   move n * LASER_PRINTER_MOVE_BUFFER_LENGHT and encodes in bulk as it is, padding included.
+*   The planners append to it, the encoders turn it into batches and the simulator decodes batches into it.
+*/
+class MoveBuffer {
+public:
+    MoveBuffer()
+        : m_size(0)
+    {
+    }
+
+    size_t size() const {
+        return m_size;
+    }
+
+    bool empty() const {
+        return m_size == 0;
+    }
+
+    size_t batchCount() const {
+        return (m_size + LASER_PRINTER_MOVE_BUFFER_LENGHT - 1) / LASER_PRINTER_MOVE_BUFFER_LENGHT;
+    }
+
+    /**
+    * \brief Batches holding LASER_PRINTER_MOVE_BUFFER_LENGHT moves.
+    */
+    size_t fullBatchCount() const {
+        return m_size / LASER_PRINTER_MOVE_BUFFER_LENGHT;
+    }
+
+    void reserve(size_t moves) {
+        if (moves > m_x.size())
+            resizeStorage(moves);
+    }
+
+    void push_back(unsigned int x, unsigned int y, uint8_t duration) {
+        if (m_size == m_x.size())
+            resizeStorage(m_size + 1);
+        m_x[m_size] = static_cast<uint16_t>(x);
+        m_y[m_size] = static_cast<uint16_t>(y);
+        m_duration[m_size] = duration;
+        m_size++;
+    }
+
+    void push_back(const LaserPrinterMove &move) {
+        push_back(move.x, move.y, move.duration);
+    }
+
+    void push_back(const PackedMove &move) {
+        push_back(move.x(), move.y(), move.duration());
+    }
+
+    void pop_back() {
+        m_size--;
+        m_x[m_size] = 0;
+        m_y[m_size] = 0;
+        m_duration[m_size] = 0;
+    }
+
+    PackedMove at(size_t index) const {
+        return PackedMove(m_x[index], m_y[index], m_duration[index]);
+    }
+
+    const uint16_t* x() const {
+        return m_x.data();
+    }
+
+    const uint16_t* y() const {
+        return m_y.data();
+    }
+
+    const uint8_t* duration() const {
+        return m_duration.data();
+    }
+
+    /**
+    * \brief Remove every move, the storage is kept.
+    */
+    void clear() {
+        eraseFront(m_size);
+    }
+
+    /**
+    * \brief Remove the first [count] batches, the following moves become the first batch.
+    */
+    void eraseBatches(size_t count) {
+        eraseFront((std::min)(count * LASER_PRINTER_MOVE_BUFFER_LENGHT, m_size));
+    }
+
+    /**
+    * \brief Write batch [index] to [packets] (LASER_PRINTER_MOVE_BUFFER_LENGHT * 4 bytes), padded with empty packets.
+    */
+    void encodeBatch(size_t index, uint8_t* packets) const {
+        size_t first = index * LASER_PRINTER_MOVE_BUFFER_LENGHT;
+        MovePacketCodec::encode(&m_x[first], &m_y[first], &m_duration[first], LASER_PRINTER_MOVE_BUFFER_LENGHT, packets);
+    }
+
+    /**
+    * \brief Append [count] 4 bytes print packets, moved by [offsetX] [offsetY].
+    */
+    void appendPackets(const uint8_t* packets, size_t count, uint16_t offsetX = 0, uint16_t offsetY = 0) {
+        reserve(m_size + count);
+        MovePacketCodec::decode(packets, count, &m_x[m_size], &m_y[m_size], &m_duration[m_size]);
+        if (offsetX != 0 || offsetY != 0) {
+            for (size_t i = m_size; i < m_size + count; i++) {
+                m_x[i] += offsetX;
+                m_y[i] += offsetY;
+            }
+        }
+        m_size += count;
+    }
+
+private:
+    void resizeStorage(size_t moves) {
+        size_t capacity = (std::max)(m_x.size() * 2, (moves + LASER_PRINTER_MOVE_BUFFER_LENGHT - 1) / LASER_PRINTER_MOVE_BUFFER_LENGHT * LASER_PRINTER_MOVE_BUFFER_LENGHT);
+        m_x.resize(capacity, 0);
+        m_y.resize(capacity, 0);
+        m_duration.resize(capacity, 0);
+    }
+
+    void eraseFront(size_t count) {
+        if (count == 0)
+            return;
+        size_t remaining = m_size - count;
+        memmove(&m_x[0], &m_x[count], remaining * sizeof(uint16_t));
+        memmove(&m_y[0], &m_y[count], remaining * sizeof(uint16_t));
+        memmove(&m_duration[0], &m_duration[count], remaining);
+        std::fill(m_x.begin() + remaining, m_x.begin() + m_size, 0);
+        std::fill(m_y.begin() + remaining, m_y.begin() + m_size, 0);
+        std::fill(m_duration.begin() + remaining, m_duration.begin() + m_size, 0);
+        m_size = remaining;
+    }
+
+    std::vector<uint16_t> m_x;
+    std::vector<uint16_t> m_y;
+    std::vector<uint8_t> m_duration;
+    size_t m_size;
+};
+
+#endif // MoveBuffer_hpp
@@ -0,0 +1,41 @@
+#ifndef MovePacketCodec_hpp
+#define MovePacketCodec_hpp
+
+#include <stdint.h>
+
+#include "LaserPrinterMove.hpp"
+
+/**
+* \brief Bulk conversion between separate x, y and duration arrays and 4 bytes print packets (see LaserPrinterMove).
+*   Bit-exact with LaserPrinterMove::toCommand() and fromCommand() for 12 bits coordinates, higher bits are ignored.
+*   Branch-free loops over plain arrays: the compiler vectorizes them at -O3, as fast for a batch as SSE2 or AVX2 intrinsics.
+*/
+class MovePacketCodec {
+public:
+    /**
+    * \brief Write [count] packets to [packets] (4 * [count] bytes).
+    */
+    static void encode(const uint16_t* x, const uint16_t* y, const uint8_t* duration, size_t count, uint8_t* packets) {
+        for (size_t i = 0; i < count; i++) {
+            uint8_t* packet = packets + i * 4;
+            packet[0] = x[i] & 0xFF;
+            packet[1] = ((x[i] >> 4) & 0xF0) | ((y[i] >> 8) & 0x0F);
+            packet[2] = y[i] & 0xFF;
+            packet[3] = duration[i];
+        }
+    }
+
+    /**
+    * \brief Read [count] packets from [packets] into the x, y and duration arrays.
+    */
+    static void decode(const uint8_t* packets, size_t count, uint16_t* x, uint16_t* y, uint8_t* duration) {
+        for (size_t i = 0; i < count; i++) {
+            const uint8_t* packet = packets + i * 4;
+            x[i] = packet[0] | ((packet[1] & 0xF0) << 4);
+            y[i] = packet[2] | ((packet[1] & 0x0F) << 8);
+            duration[i] = packet[3];
+        }
+    }
+};
+
+#endif // MovePacketCodec_hpp
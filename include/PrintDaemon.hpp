@@ -0,0 +1,396 @@
+#ifndef PrintDaemon_hpp
+#define PrintDaemon_hpp
+
+#ifndef _WIN32
+
+#include <string>
+#include <vector>
+#include <map>
+#include <sstream>
+#include <fstream>
+#include <atomic>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "LaserPrinter.hpp"
+#include "SVGParser.hpp"
+#include "SharedJobRing.hpp"
+
+#define PRINT_DAEMON_POLL_MS 200 // how often serve() checks stop()
+#define PRINT_DAEMON_MAX_LINE 4096
+#define PRINT_DAEMON_HISTORY 256 // finished jobs kept for STATUS
+
+/**
+* \brief Long running print server: keeps the printer connection open and takes jobs on a local Unix socket,
+*   so a job costs neither a process start nor the connection handshake.
+*   Text protocol, one command per line, one answer line per command ("OK ..." or "ERROR <reason>"):
+*     SVG <fan 0|1> <path>        queue an SVG file                       -> OK <job id>
+*     PGM <fan 0|1> <path>        queue a binary PGM image, black burns the longest, white is skipped -> OK <job id>
+*     MOVES <fan 0|1> <path>      queue a file of 4 bytes print packets, printed as they are -> OK <job id>
+*     LPM <path>                  queue a compiled job file with its own origin and settings, see PrintProgramFile -> OK <job id>
+*     STATUS [id]                 state of one job, or "OK <count>" followed by one line per job:
+*                                 <id> queued|printing|done|failed <batches sent> <moves sent> <result> <description>
+*     CANCEL <id>                 drop or stop a job
+*     ORIGIN <x> <y>              origin of the jobs queued from now on
+*     POWER <0..1>, DEPTH <0..1>  laser power and engraving depth of the jobs queued from now on
+*     PAUSE, RESUME               hold or continue the running job
+*     PING
+*/
+class PrintDaemon {
+public:
+    PrintDaemon(LaserPrinter &printer, const std::string &socketPath)
+        : m_printer(printer)
+        , m_socketPath(socketPath)
+        , m_listener(-1)
+        , m_nextId(1)
+        , m_sharedJobs(NULL)
+        , m_stop(false)
+    {
+    }
+
+    ~PrintDaemon() {
+        for (size_t i = 0; i < m_clients.size(); i++)
+            ::close(m_clients[i].fd);
+        if (m_listener >= 0) {
+            ::close(m_listener);
+            unlink(m_socketPath.c_str());
+        }
+    }
+
+    /**
+    * \brief Create the socket, replacing a stale one left by a previous run.
+    */
+    bool listen() {
+        struct sockaddr_un address;
+        memset(&address, 0, sizeof(address));
+        address.sun_family = AF_UNIX;
+        if (m_socketPath.length() >= sizeof(address.sun_path))
+            return false;
+        strcpy(address.sun_path, m_socketPath.c_str());
+        m_listener = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (m_listener < 0)
+            return false;
+        unlink(m_socketPath.c_str());
+        if (bind(m_listener, (struct sockaddr*)&address, sizeof(address)) != 0 || ::listen(m_listener, 8) != 0) {
+            printf("ERROR: could not listen on %s (%s)\n", m_socketPath.c_str(), strerror(errno));
+            ::close(m_listener);
+            m_listener = -1;
+            return false;
+        }
+        fcntl(m_listener, F_SETFL, O_NONBLOCK);
+        return true;
+    }
+
+    /**
+    * \brief Also queue the jobs handed over through shared memory, serve() then polls [receiver] every SHARED_JOB_POLL_MS.
+    */
+    void setSharedJobs(SharedJobReceiver* receiver) {
+        m_sharedJobs = receiver;
+    }
+
+    /**
+    * \brief Answer the clients until stop().
+    */
+    void serve() {
+        while (!m_stop) {
+            std::vector<struct pollfd> fds(1 + m_clients.size());
+            fds[0].fd = m_listener;
+            fds[0].events = POLLIN;
+            fds[0].revents = 0;
+            for (size_t i = 0; i < m_clients.size(); i++) {
+                fds[i + 1].fd = m_clients[i].fd;
+                fds[i + 1].events = POLLIN;
+                fds[i + 1].revents = 0;
+            }
+            int ready = poll(&fds[0], fds.size(), m_sharedJobs != NULL ? SHARED_JOB_POLL_MS : PRINT_DAEMON_POLL_MS);
+            if (m_sharedJobs != NULL)
+                m_sharedJobs->poll();
+            if (ready <= 0)
+                continue;
+            //Clients first: accepting changes m_clients
+            for (size_t i = m_clients.size(); i > 0; i--) {
+                if (fds[i].revents != 0 && !readClient(m_clients[i - 1])) {
+                    ::close(m_clients[i - 1].fd);
+                    m_clients.erase(m_clients.begin() + (i - 1));
+                }
+            }
+            if (fds[0].revents & POLLIN) {
+                int fd = accept(m_listener, NULL, NULL);
+                if (fd >= 0) {
+                    Client client;
+                    client.fd = fd;
+                    m_clients.push_back(client);
+                }
+            }
+        }
+    }
+
+    /**
+    * \brief Make serve() return within PRINT_DAEMON_POLL_MS, safe from a signal handler.
+    */
+    void stop() {
+        m_stop = true;
+    }
+
+    /**
+    * \brief Run one protocol command, as if received from a client.
+    * \return the answer, without the final line feed
+    */
+    std::string execute(const std::string &line) {
+        std::istringstream in(line);
+        std::string command;
+        in >> command;
+        if (command == "SVG" || command == "PGM" || command == "MOVES") {
+            int fan = 0;
+            std::string path;
+            in >> fan;
+            std::getline(in >> std::ws, path);
+            if (path.empty())
+                return "ERROR missing file path";
+            std::string error;
+            LaserPrintJob job = submitFile(command, path, fan != 0, error);
+            if (!job.isValid())
+                return "ERROR " + error;
+            forgetFinishedJobs();
+            int id = m_nextId++;
+            m_jobs[id].handle = job;
+            m_jobs[id].description = command + " " + path;
+            return "OK " + std::to_string(id);
+        }
+        if (command == "LPM") {
+            std::string path;
+            std::getline(in >> std::ws, path);
+            if (path.empty())
+                return "ERROR missing file path";
+            forgetFinishedJobs();
+            int id = m_nextId++;
+            m_jobs[id].handle = m_printer.submitProgramFile(path);
+            m_jobs[id].description = command + " " + path;
+            return "OK " + std::to_string(id);
+        }
+        if (command == "STATUS") {
+            int id = 0;
+            if (in >> id) {
+                if (m_jobs.find(id) == m_jobs.end())
+                    return "ERROR unknown job " + std::to_string(id);
+                return "OK " + jobStatus(id);
+            }
+            std::string answer = "OK " + std::to_string(m_jobs.size());
+            for (std::map<int, DaemonJob>::iterator it = m_jobs.begin(); it != m_jobs.end(); ++it)
+                answer += "\n" + jobStatus(it->first);
+            return answer;
+        }
+        if (command == "CANCEL") {
+            int id = 0;
+            in >> id;
+            if (m_jobs.find(id) == m_jobs.end())
+                return "ERROR unknown job " + std::to_string(id);
+            m_jobs[id].handle.cancel();
+            return "OK";
+        }
+        if (command == "ORIGIN") {
+            unsigned int x = 0;
+            unsigned int y = 0;
+            if (!(in >> x >> y))
+                return "ERROR expected ORIGIN <x> <y>";
+            m_printer.setPrintOrigin(x, y);
+            return "OK";
+        }
+        if (command == "POWER" || command == "DEPTH") {
+            float value = 0;
+            if (!(in >> value) || value < 0 || value > 1)
+                return "ERROR expected a value between 0 and 1";
+            //Queued, the printer is busy with the jobs before
+            bool power = command == "POWER";
+            m_printer.submitTask([power, value](LaserPrinter &printer) {
+                if (power)
+                    printer.setLaserPower(value);
+                else
+                    printer.setEngravingDepth(value);
+                return static_cast<int>(LASER_PRINTER_OK);
+            });
+            return "OK";
+        }
+        if (command == "PAUSE") {
+            m_printer.pause();
+            return "OK";
+        }
+        if (command == "RESUME") {
+            m_printer.resume();
+            return "OK";
+        }
+        if (command == "PING")
+            return "OK";
+        return "ERROR unknown command " + command;
+    }
+
+    /**
+    * \brief Read a binary PGM (P5, 8 bits) as burn durations: 255 - grey level.
+    *   Images larger than the printing area are rejected before anything is allocated.
+    */
+    static bool loadPGM(const std::string &filePath, std::vector<uint8_t> &image, int &width, int &height) {
+        std::ifstream file(filePath.c_str(), std::ios::binary);
+        std::string magic;
+        int maxValue = 0;
+        file >> magic;
+        if (magic != "P5")
+            return false;
+        int* fields[3] = { &width, &height, &maxValue };
+        for (int f = 0; f < 3; f++) {
+            file >> std::ws;
+            while (file.peek() == '#') {
+                std::string comment;
+                std::getline(file, comment);
+                file >> std::ws;
+            }
+            file >> *fields[f];
+        }
+        if (!file || width <= 0 || height <= 0 || maxValue <= 0 || maxValue > 255)
+            return false;
+        if (width > LASER_PRINTER_RESOLUTION_WIDTH || height > LASER_PRINTER_RESOLUTION_HEIGHT)
+            return false;
+        file.get();
+        image.resize(static_cast<size_t>(width) * height);
+        file.read((char*)&image[0], image.size());
+        if (file.gcount() != static_cast<std::streamsize>(image.size()))
+            return false;
+        for (size_t i = 0; i < image.size(); i++)
+            image[i] = 255 - (image[i] * 255 / maxValue);
+        return true;
+    }
+
+    /**
+    * \brief Read a file of 4 bytes print packets, kept as they are to be sent unchanged. The job size is the extent of its moves.
+    */
+    static bool loadMoves(const std::string &filePath, std::vector<uint8_t> &packets, int &width, int &height) {
+        std::ifstream file(filePath.c_str(), std::ios::binary);
+        packets.assign((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+        if (!file.is_open() || packets.empty() || packets.size() % 4 != 0)
+            return false;
+        width = 0;
+        height = 0;
+        LaserPrinterMove move;
+        for (size_t i = 0; i < packets.size(); i += 4) {
+            move.fromCommand(&packets[i]);
+            width = (std::max)(width, static_cast<int>(move.x) + 1);
+            height = (std::max)(height, static_cast<int>(move.y) + 1);
+        }
+        return true;
+    }
+
+private:
+    struct Client {
+        int fd;
+        std::string pending;    // bytes received after the last complete line
+    };
+
+    struct DaemonJob {
+        LaserPrintJob handle;
+        std::string description;
+    };
+
+    /**
+    * \return false once the client is gone
+    */
+    bool readClient(Client &client) {
+        char buffer[1024];
+        ssize_t length = ::read(client.fd, buffer, sizeof(buffer));
+        if (length <= 0)
+            return length < 0 && (errno == EAGAIN || errno == EINTR);
+        client.pending.append(buffer, length);
+        size_t end;
+        while ((end = client.pending.find('\n')) != std::string::npos) {
+            std::string line = client.pending.substr(0, end);
+            client.pending.erase(0, end + 1);
+            if (!line.empty() && line[line.length() - 1] == '\r')
+                line.erase(line.length() - 1);
+            if (line.empty())
+                continue;
+            std::string answer = execute(line) + "\n";
+            if (send(client.fd, answer.c_str(), answer.length(), MSG_NOSIGNAL) != static_cast<ssize_t>(answer.length()))
+                return false;
+        }
+        return client.pending.length() <= PRINT_DAEMON_MAX_LINE;
+    }
+
+    LaserPrintJob submitFile(const std::string &type, const std::string &path, bool fan, std::string &error) {
+        int width = 0;
+        int height = 0;
+        if (type == "SVG") {
+            //Parsed and planned on the worker thread: a large drawing must not hold the other clients
+            if (std::ifstream(path.c_str()).good())
+                return m_printer.submitShape([path](int &svgWidth, int &svgHeight) { return SVGParser::getSegments(path, svgWidth, svgHeight); }, fan);
+            error = "could not read the SVG file " + path;
+        }
+        else if (type == "PGM") {
+            std::vector<uint8_t> image;
+            if (loadPGM(path, image, width, height))
+                return m_printer.submitImage(&image[0], width, height, fan);
+            error = "could not read the binary PGM file " + path;
+        }
+        else {
+            std::vector<uint8_t> packets;
+            if (loadMoves(path, packets, width, height))
+                return m_printer.submitPackets(packets, width, height, fan);
+            error = "could not read the move file " + path;
+        }
+        return LaserPrintJob();
+    }
+
+    /**
+    * \brief Drop the oldest finished jobs beyond PRINT_DAEMON_HISTORY.
+    */
+    void forgetFinishedJobs() {
+        size_t finished = 0;
+        for (std::map<int, DaemonJob>::iterator it = m_jobs.begin(); it != m_jobs.end(); ++it)
+            finished += it->second.handle.isDone() ? 1 : 0;
+        for (std::map<int, DaemonJob>::iterator it = m_jobs.begin(); it != m_jobs.end() && finished > PRINT_DAEMON_HISTORY;) {
+            if (it->second.handle.isDone()) {
+                m_jobs.erase(it++);
+                finished--;
+            }
+            else {
+                ++it;
+            }
+        }
+    }
+
+    std::string jobStatus(int id) {
+        DaemonJob &job = m_jobs[id];
+        std::string state = "queued";
+        int result = 0;
+        if (job.handle.isDone()) {
+            result = job.handle.wait();
+            state = result == LASER_PRINTER_OK ? "done" : "failed";
+        }
+        else if (job.handle.batchesSent() > 0) {
+            state = "printing";
+        }
+        std::string status = std::to_string(id) + " " + state + " " + std::to_string(job.handle.batchesSent()) + " "
+            + std::to_string(job.handle.movesSent()) + " " + std::to_string(result) + " " + job.description;
+        if (result != LASER_PRINTER_OK)
+            status += " (" + job.handle.errorMessage() + ")";
+        return status;
+    }
+
+    LaserPrinter &m_printer;
+    std::string m_socketPath;
+    int m_listener;
+    std::vector<Client> m_clients;
+    std::map<int, DaemonJob> m_jobs;
+    int m_nextId;
+    SharedJobReceiver* m_sharedJobs;
+    std::atomic<bool> m_stop;
+};
+
+#endif // _WIN32
+
+#endif // PrintDaemon_hpp
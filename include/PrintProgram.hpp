@@ -0,0 +1,168 @@
+#ifndef PrintProgram_hpp
+#define PrintProgram_hpp
+
+#include <vector>
+#include <memory>
+#include <algorithm>
+#include <stdint.h>
+
+#include "LaserPrinterMove.hpp"
+#include "MovePacketCodec.hpp"
+
+/**
+* \brief A job compiled once (see LaserPrinter::compileShape, compileImage and compileMoves) and printed any number of times:
+*   the batches are planned and encoded already, LaserPrinter streams them in place.
+*   Shared as std::shared_ptr<const PrintProgram>, a compiled program never changes.
+*/
+class PrintProgram {
+public:
+    PrintProgram(int width, int height)
+        : m_width(width)
+        , m_height(height)
+        , m_moveCount(0)
+        , m_durationSum(0)
+        , m_minX(LASER_PRINTER_RESOLUTION_WIDTH)
+        , m_minY(LASER_PRINTER_RESOLUTION_HEIGHT)
+        , m_maxX(0)
+        , m_maxY(0)
+        , m_externalBatches(NULL)
+        , m_externalCount(0)
+    {
+    }
+
+    /**
+    * \brief Program over [batchCount] batches stored elsewhere, e.g. a mapped .lpm file (see PrintProgramFile),
+    *   [owner] keeps them alive as long as the program.
+    */
+    PrintProgram(int width, int height, const uint8_t* batches, size_t batchCount, std::shared_ptr<const void> owner)
+        : m_width(width)
+        , m_height(height)
+        , m_moveCount(0)
+        , m_durationSum(0)
+        , m_minX(LASER_PRINTER_RESOLUTION_WIDTH)
+        , m_minY(LASER_PRINTER_RESOLUTION_HEIGHT)
+        , m_maxX(0)
+        , m_maxY(0)
+        , m_externalBatches(batches)
+        , m_externalCount(batchCount)
+        , m_owner(owner)
+    {
+    }
+
+    /**
+    * \brief Size of the job, as given to the compiler: what the print area is checked against.
+    */
+    int width() const {
+        return m_width;
+    }
+
+    int height() const {
+        return m_height;
+    }
+
+    size_t batchCount() const {
+        return m_externalBatches != NULL ? m_externalCount : m_batches.size() / batchSize();
+    }
+
+    /**
+    * \brief The batchCount() batches, one after the other.
+    */
+    const uint8_t* batches() const {
+        return m_externalBatches != NULL ? m_externalBatches : m_batches.data();
+    }
+
+    const uint8_t* batch(size_t index) const {
+        return batches() + index * batchSize();
+    }
+
+    bool empty() const {
+        return m_moveCount == 0;
+    }
+
+    /**
+    * \brief Moves that burn, the empty packets excluded.
+    */
+    size_t moveCount() const {
+        return m_moveCount;
+    }
+
+    /**
+    * \brief Sum of the burn durations: the burn time is proportional to it.
+    */
+    uint64_t durationSum() const {
+        return m_durationSum;
+    }
+
+    /**
+    * \brief Bounding box of the moves that burn, relative to the print origin. Only valid if !empty().
+    */
+    unsigned int minX() const {
+        return m_minX;
+    }
+
+    unsigned int minY() const {
+        return m_minY;
+    }
+
+    unsigned int maxX() const {
+        return m_maxX;
+    }
+
+    unsigned int maxY() const {
+        return m_maxY;
+    }
+
+    /**
+    * \brief Batch sink of the encoders while compiling, like the producer side of BatchQueue.
+    */
+    size_t batchSize() const {
+        return LASER_PRINTER_MOVE_BUFFER_LENGHT * 4;
+    }
+
+    uint8_t* beginWrite() {
+        m_batches.resize(m_batches.size() + batchSize());
+        return &m_batches[m_batches.size() - batchSize()];
+    }
+
+    /**
+    * \brief Account for the batch written since beginWrite().
+    */
+    void commitWrite() {
+        uint16_t x[LASER_PRINTER_MOVE_BUFFER_LENGHT];
+        uint16_t y[LASER_PRINTER_MOVE_BUFFER_LENGHT];
+        uint8_t duration[LASER_PRINTER_MOVE_BUFFER_LENGHT];
+        MovePacketCodec::decode(&m_batches[m_batches.size() - batchSize()], LASER_PRINTER_MOVE_BUFFER_LENGHT, x, y, duration);
+        for (size_t i = 0; i < LASER_PRINTER_MOVE_BUFFER_LENGHT; i++) {
+            if (duration[i] == 0)
+                continue;
+            m_moveCount++;
+            m_durationSum += duration[i];
+            m_minX = (std::min)(m_minX, static_cast<unsigned int>(x[i]));
+            m_minY = (std::min)(m_minY, static_cast<unsigned int>(y[i]));
+            m_maxX = (std::max)(m_maxX, static_cast<unsigned int>(x[i]));
+            m_maxY = (std::max)(m_maxY, static_cast<unsigned int>(y[i]));
+        }
+    }
+
+    void close() {
+        m_batches.shrink_to_fit();
+    }
+
+private:
+    friend class PrintProgramFile;
+
+    int m_width;
+    int m_height;
+    std::vector<uint8_t> m_batches;
+    size_t m_moveCount;
+    uint64_t m_durationSum;
+    unsigned int m_minX;
+    unsigned int m_minY;
+    unsigned int m_maxX;
+    unsigned int m_maxY;
+    const uint8_t* m_externalBatches;   // NULL when the program owns m_batches
+    size_t m_externalCount;
+    std::shared_ptr<const void> m_owner;
+};
+
+#endif // PrintProgram_hpp
@@ -0,0 +1,237 @@
+#ifndef PrintProgramFile_hpp
+#define PrintProgramFile_hpp
+
+#include <string>
+#include <vector>
+#include <memory>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#ifndef _WIN32
+    #include <fcntl.h>
+    #include <unistd.h>
+    #include <sys/mman.h>
+    #include <sys/stat.h>
+#endif
+
+#include "PrintProgram.hpp"
+#include "JobCheckpoint.hpp"
+
+#define PRINT_PROGRAM_FILE_MAGIC "LPMJOB\r\n"    // a text transfer damages it
+#define PRINT_PROGRAM_FILE_VERSION 1
+#define PRINT_PROGRAM_FILE_HEADER_SIZE 1024       // one batch: the batches are aligned in the file
+#define PRINT_PROGRAM_FILE_KEEP_SETTING 0xFFFFFFFFu
+
+/**
+* \brief Settings saved with a compiled job, applied by LaserPrinter::printProgramFile().
+*/
+struct PrintProgramSettings {
+    unsigned int originX;
+    unsigned int originY;
+    bool fan;
+    float power;    // 0 to 1, negative to keep the printer's setting
+    float depth;    // 0 to 1, negative to keep the printer's setting
+
+    PrintProgramSettings()
+        : originX(0)
+        , originY(0)
+        , fan(false)
+        , power(-1)
+        , depth(-1)
+    {
+    }
+};
+
+/**
+* \brief Compiled job file (.lpm): a 1024 bytes header, then the batches as sent to the printer.
+*   Header, little endian: magic[8], version, header size, batch size, flags (1: fan), batch count (64 bits),
+*   width, height, originX, originY, power and depth (thousandths, 0xFFFFFFFF to keep the printer's setting),
+*   move count and duration sum (64 bits), minX, minY, maxX, maxY, FNV-1a of the batches, FNV-1a of the header before it.
+*   The rest of the header is zero. The file is mapped, not read: printing starts without parsing nor planning.
+*/
+class PrintProgramFile {
+public:
+    /**
+    * \brief Write [program] to [path] through a temporary file, so a crash never leaves a truncated one.
+    * \return false if it could not be written, if the power or the depth is above 1 or not a number,
+    *   or if the origin or the size is out of the printing area
+    */
+    static bool save(const std::string &path, const PrintProgram &program, const PrintProgramSettings &settings) {
+        if (!isValidSetting(settings.power) || !isValidSetting(settings.depth)
+            || !isInPrintArea(settings.originX, settings.originY, program.width(), program.height()))
+            return false;
+        uint8_t header[PRINT_PROGRAM_FILE_HEADER_SIZE];
+        memset(header, 0, sizeof(header));
+        memcpy(header, PRINT_PROGRAM_FILE_MAGIC, 8);
+        put32(header + 8, PRINT_PROGRAM_FILE_VERSION);
+        put32(header + 12, PRINT_PROGRAM_FILE_HEADER_SIZE);
+        put32(header + 16, static_cast<uint32_t>(program.batchSize()));
+        put32(header + 20, settings.fan ? 1 : 0);
+        put64(header + 24, program.batchCount());
+        put32(header + 32, static_cast<uint32_t>(program.width()));
+        put32(header + 36, static_cast<uint32_t>(program.height()));
+        put32(header + 40, settings.originX);
+        put32(header + 44, settings.originY);
+        put32(header + 48, toThousandths(settings.power));
+        put32(header + 52, toThousandths(settings.depth));
+        put64(header + 56, program.moveCount());
+        put64(header + 64, program.durationSum());
+        put32(header + 72, program.minX());
+        put32(header + 76, program.minY());
+        put32(header + 80, program.maxX());
+        put32(header + 84, program.maxY());
+        put32(header + 88, JobCheckpoint::hash(2166136261u, program.batches(), program.batchCount() * program.batchSize()));
+        put32(header + 92, JobCheckpoint::hash(2166136261u, header, 92));
+
+        std::string tmpPath = path + ".tmp";
+        FILE* file = fopen(tmpPath.c_str(), "wb");
+        if (file == NULL)
+            return false;
+        size_t length = program.batchCount() * program.batchSize();
+        bool written = fwrite(header, 1, sizeof(header), file) == sizeof(header)
+            && (length == 0 || fwrite(program.batches(), 1, length, file) == length);
+        if (fclose(file) != 0 || !written) {
+            ::remove(tmpPath.c_str());
+            return false;
+        }
+        return rename(tmpPath.c_str(), path.c_str()) == 0;
+    }
+
+    /**
+    * \brief Map [path] and check it. The program reads the batches in place, the mapping lives as long as the program.
+    * \return NULL with the reason in [error] if [path] is not a valid compiled job
+    */
+    static std::shared_ptr<const PrintProgram> load(const std::string &path, PrintProgramSettings &settings, std::string &error) {
+        size_t size = 0;
+        std::shared_ptr<const void> mapping = map(path, size);
+        if (!mapping) {
+            error = "could not open " + path;
+            return std::shared_ptr<const PrintProgram>();
+        }
+        const uint8_t* header = (const uint8_t*)mapping.get();
+        if (size < PRINT_PROGRAM_FILE_HEADER_SIZE || memcmp(header, PRINT_PROGRAM_FILE_MAGIC, 8) != 0
+            || get32(header + 92) != JobCheckpoint::hash(2166136261u, header, 92)) {
+            error = path + " is not a compiled job";
+            return std::shared_ptr<const PrintProgram>();
+        }
+        uint64_t batchCount = get64(header + 24);
+        const uint8_t* batches = header + PRINT_PROGRAM_FILE_HEADER_SIZE;
+        if (get32(header + 8) != PRINT_PROGRAM_FILE_VERSION || get32(header + 12) != PRINT_PROGRAM_FILE_HEADER_SIZE
+            || get32(header + 16) != LASER_PRINTER_MOVE_BUFFER_LENGHT * 4) {
+            error = path + " was compiled for another version";
+            return std::shared_ptr<const PrintProgram>();
+        }
+        if (batchCount > (size - PRINT_PROGRAM_FILE_HEADER_SIZE) / (LASER_PRINTER_MOVE_BUFFER_LENGHT * 4)
+            || get32(header + 88) != JobCheckpoint::hash(2166136261u, batches, static_cast<size_t>(batchCount) * LASER_PRINTER_MOVE_BUFFER_LENGHT * 4)) {
+            error = path + " is truncated or damaged";
+            return std::shared_ptr<const PrintProgram>();
+        }
+
+        //The checksum only tells the header is intact: the settings are sent to the printer, check them
+        uint32_t power = get32(header + 48);
+        uint32_t depth = get32(header + 52);
+        if ((power > 1000 && power != PRINT_PROGRAM_FILE_KEEP_SETTING) || (depth > 1000 && depth != PRINT_PROGRAM_FILE_KEEP_SETTING)) {
+            error = path + " has a laser power or an engraving depth above 1";
+            return std::shared_ptr<const PrintProgram>();
+        }
+        uint32_t width = get32(header + 32);
+        uint32_t height = get32(header + 36);
+        uint32_t originX = get32(header + 40);
+        uint32_t originY = get32(header + 44);
+        if (width > LASER_PRINTER_RESOLUTION_WIDTH || height > LASER_PRINTER_RESOLUTION_HEIGHT
+            || !isInPrintArea(originX, originY, static_cast<int>(width), static_cast<int>(height))) {
+            error = path + " is out of the printing area";
+            return std::shared_ptr<const PrintProgram>();
+        }
+
+        settings.fan = (get32(header + 20) & 1) != 0;
+        settings.originX = originX;
+        settings.originY = originY;
+        settings.power = fromThousandths(power);
+        settings.depth = fromThousandths(depth);
+        std::shared_ptr<PrintProgram> program = std::make_shared<PrintProgram>(static_cast<int>(width),
+            static_cast<int>(height), batches, static_cast<size_t>(batchCount), mapping);
+        program->m_moveCount = static_cast<size_t>(get64(header + 56));
+        program->m_durationSum = get64(header + 64);
+        program->m_minX = get32(header + 72);
+        program->m_minY = get32(header + 76);
+        program->m_maxX = get32(header + 80);
+        program->m_maxY = get32(header + 84);
+        return program;
+    }
+
+private:
+    /**
+    * \brief The whole file, read only. Read into memory where mmap is not available.
+    */
+    static std::shared_ptr<const void> map(const std::string &path, size_t &size) {
+#ifndef _WIN32
+        int fd = open(path.c_str(), O_RDONLY);
+        if (fd < 0)
+            return std::shared_ptr<const void>();
+        struct stat info;
+        void* data = MAP_FAILED;
+        if (fstat(fd, &info) == 0 && info.st_size > 0)
+            data = mmap(NULL, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        ::close(fd);
+        if (data == MAP_FAILED)
+            return std::shared_ptr<const void>();
+        size = info.st_size;
+        madvise(data, size, MADV_SEQUENTIAL);
+        return std::shared_ptr<const void>(data, [size](const void* mapped) { munmap(const_cast<void*>(mapped), size); });
+#else
+        FILE* file = fopen(path.c_str(), "rb");
+        if (file == NULL)
+            return std::shared_ptr<const void>();
+        std::shared_ptr<std::vector<uint8_t> > content = std::make_shared<std::vector<uint8_t> >();
+        uint8_t buffer[65536];
+        size_t length;
+        while ((length = fread(buffer, 1, sizeof(buffer), file)) > 0)
+            content->insert(content->end(), buffer, buffer + length);
+        fclose(file);
+        if (content->empty())
+            return std::shared_ptr<const void>();
+        size = content->size();
+        return std::shared_ptr<const void>(content, content->data());
+#endif
+    }
+
+    /**
+    * \brief Negative keeps the printer's setting, otherwise 0 to 1. NaN is not valid.
+    */
+    static bool isValidSetting(float value) {
+        return value < 0 || value <= 1;
+    }
+
+    /**
+    * \brief [value] checked by isValidSetting().
+    */
+    static uint32_t toThousandths(float value) {
+        return value < 0 ? PRINT_PROGRAM_FILE_KEEP_SETTING : static_cast<uint32_t>(value * 1000 + 0.5f);
+    }
+
+    static float fromThousandths(uint32_t value) {
+        return value == PRINT_PROGRAM_FILE_KEEP_SETTING ? -1.0f : value / 1000.0f;
+    }
+
+    static void put32(uint8_t* out, uint32_t value) {
+        for (int i = 0; i < 4; i++)
+            out[i] = static_cast<uint8_t>(value >> (8 * i));
+    }
+
+    static void put64(uint8_t* out, uint64_t value) {
+        for (int i = 0; i < 8; i++)
+            out[i] = static_cast<uint8_t>(value >> (8 * i));
+    }
+
+    static uint32_t get32(const uint8_t* in) {
+        return in[0] | (in[1] << 8) | (in[2] << 16) | (static_cast<uint32_t>(in[3]) << 24);
+    }
+
+    static uint64_t get64(const uint8_t* in) {
+        return get32(in) | (static_cast<uint64_t>(get32(in + 4)) << 32);
+    }
+};
+
+#endif // PrintProgramFile_hpp
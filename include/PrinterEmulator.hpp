@@ -0,0 +1,311 @@
+#ifndef PrinterEmulator_hpp
+#define PrinterEmulator_hpp
+
+#include <string>
+#include <vector>
+#include <deque>
+#include <thread>
+#include <atomic>
+#include <chrono>
+#include <random>
+#include <algorithm>
+#include <stdint.h>
+
+#include <fcntl.h>
+#include <termios.h>
+#include <unistd.h>
+#include <poll.h>
+#include <errno.h>
+#include <stdlib.h>
+
+#include "LaserPrinterMove.hpp"
+
+/**
+* \brief Timing model of the emulated firmware. All durations are in microseconds.
+*/
+struct PrinterEmulatorTiming {
+    int connectDelayUs = 100000;    // "$40" -> "connect"
+    int commandDelayUs = 1000;      // "$20" "$25" "$30" "$42" -> "ok"
+    int batchBaseUs = 2000;         // fixed processing cost of a batch
+    int burnUsPerUnit = 10;         // added per unit of burn duration in the batch
+    int finishDelayUs = 10000;      // last batch processed -> "F22"
+    int jitterUs = 0;               // uniform random delay added to every reply, between 0 and jitterUs
+    int commandGapUs = 2000;        // silence that terminates a "$" command (commands have no terminator)
+    int bufferDepth = 1;            // batches held by the firmware (processing included), extra batches are dropped unanswered
+    unsigned int seed = 1;
+};
+
+/**
+* \brief Counters of what the emulated firmware received.
+*/
+struct PrinterEmulatorStats {
+    size_t commands = 0;
+    size_t jobs = 0;
+    size_t batches = 0;
+    size_t moves = 0;         // packets with a non zero burn duration
+    size_t overflows = 0;     // batches dropped because the buffer was full
+    size_t maxInFlight = 0;   // highest number of batches buffered at once
+    size_t bytesReceived = 0;
+};
+
+/**
+* \brief Stand-in for the engraver firmware, speaking the protocol LaserPrinter uses.
+*   - Idle: "$" commands, answered "connect" for $40, "ok" for $20/$25/$30/$42, nothing for $8/$9/$10.
+*   - "$30" starts a job: every 1024 bytes are a batch, answered "B1" once processed.
+*   - "$33" at a batch boundary ends the job, answered "F22" once every batch is processed.
+*   Processing is sequential, like the real printer: a batch starts when the previous one is done.
+*   Up to bufferDepth batches are held at once, a batch received when full is dropped without answer.
+*   The protocol engine is transport agnostic (feed()/poll()), start() hosts it on a pseudo-terminal.
+*/
+class PrinterEmulator {
+public:
+    typedef std::chrono::steady_clock Clock;
+
+    PrinterEmulator(PrinterEmulatorTiming timing = PrinterEmulatorTiming())
+        : m_timing(timing)
+        , m_random(timing.seed)
+        , m_streaming(false)
+        , m_inFlight(0)
+        , m_lastByteTime(Clock::now())
+        , m_busyUntil(Clock::now())
+        , m_master(-1)
+        , m_running(false)
+    {
+    }
+
+    ~PrinterEmulator() {
+        stop();
+    }
+
+    /**
+    * \brief Open a pseudo-terminal and serve it from a background thread.
+    * \return the device path the driver should open, empty on failure.
+    */
+    std::string start() {
+        m_master = posix_openpt(O_RDWR | O_NOCTTY);
+        if (m_master < 0)
+            return "";
+        if (grantpt(m_master) != 0 || unlockpt(m_master) != 0) {
+            close(m_master);
+            m_master = -1;
+            return "";
+        }
+        m_slavePath = ptsname(m_master);
+        //Hold the slave open in raw mode so the line discipline never echoes or translates batches
+        m_slave = open(m_slavePath.c_str(), O_RDWR | O_NOCTTY);
+        struct termios tty;
+        if (m_slave >= 0 && tcgetattr(m_slave, &tty) == 0) {
+            cfmakeraw(&tty);
+            tcsetattr(m_slave, TCSANOW, &tty);
+        }
+        fcntl(m_master, F_SETFL, fcntl(m_master, F_GETFL) | O_NONBLOCK);
+        m_running = true;
+        m_thread = std::thread(&PrinterEmulator::serve, this);
+        return m_slavePath;
+    }
+
+    void stop() {
+        if (!m_running)
+            return;
+        m_running = false;
+        m_thread.join();
+        close(m_slave);
+        close(m_master);
+        m_master = -1;
+    }
+
+    std::string devicePath() {
+        return m_slavePath;
+    }
+
+    /**
+    * \brief Counters snapshot. Only consistent once stopped, or from the serving thread.
+    */
+    PrinterEmulatorStats stats() {
+        return m_stats;
+    }
+
+    /**
+    * \brief Protocol engine: consume bytes received at [now].
+    */
+    void feed(const char* data, size_t length, Clock::time_point now) {
+        m_stats.bytesReceived += length;
+        m_lastByteTime = now;
+        m_input.insert(m_input.end(), data, data + length);
+        parse(now, false);
+    }
+
+    /**
+    * \brief Protocol engine: advance time, returns the bytes to send back now.
+    */
+    std::string poll(Clock::time_point now) {
+        if (!m_input.empty() && now - m_lastByteTime >= std::chrono::microseconds(m_timing.commandGapUs))
+            parse(now, true);
+        std::string out;
+        while (!m_replies.empty() && m_replies.front().time <= now) {
+            out += m_replies.front().message;
+            if (m_replies.front().message == "B1")
+                m_inFlight--;
+            m_replies.pop_front();
+        }
+        return out;
+    }
+
+    /**
+    * \brief Protocol engine: time of the next event poll() has to run for, or time_point::max().
+    */
+    Clock::time_point nextEvent() {
+        Clock::time_point next = Clock::time_point::max();
+        if (!m_replies.empty())
+            next = m_replies.front().time;
+        if (!m_input.empty())
+            next = (std::min)(next, m_lastByteTime + std::chrono::microseconds(m_timing.commandGapUs));
+        return next;
+    }
+
+private:
+    struct Reply {
+        Clock::time_point time;
+        std::string message;
+    };
+
+    void serve() {
+        char buffer[4096];
+        while (m_running) {
+            Clock::time_point now = Clock::now();
+            Clock::time_point next = nextEvent();
+            int timeoutMs = 20;
+            if (next != Clock::time_point::max()) {
+                long long waitUs = std::chrono::duration_cast<std::chrono::microseconds>(next - now).count();
+                timeoutMs = (std::max)(0, (std::min)(20, static_cast<int>((waitUs + 999) / 1000)));
+            }
+            struct pollfd pfd;
+            pfd.fd = m_master;
+            pfd.events = POLLIN;
+            pfd.revents = 0;
+            if (::poll(&pfd, 1, timeoutMs) > 0 && (pfd.revents & POLLIN)) {
+                ssize_t n = ::read(m_master, buffer, sizeof(buffer));
+                if (n > 0)
+                    feed(buffer, n, Clock::now());
+            }
+            std::string out = poll(Clock::now());
+            if (!out.empty())
+                writeAll(out);
+        }
+    }
+
+    void writeAll(const std::string &message) {
+        size_t sent = 0;
+        while (sent < message.length() && m_running) {
+            ssize_t n = ::write(m_master, message.c_str() + sent, message.length() - sent);
+            if (n > 0)
+                sent += n;
+            else if (n < 0 && errno != EAGAIN && errno != EINTR)
+                return;
+        }
+    }
+
+    /**
+    * \param gapElapsed: the line has been silent long enough for a pending "$" command to be complete.
+    */
+    void parse(Clock::time_point now, bool gapElapsed) {
+        while (!m_input.empty()) {
+            if (m_streaming) {
+                //At a batch boundary a short "$" message is the end of job command, decided by the next bytes or the gap
+                bool maybeCommand = m_batch.empty() && m_input.front() == '$' && m_input.size() < LASER_PRINTER_MOVE_BUFFER_LENGHT * 4;
+                if (maybeCommand && !gapElapsed)
+                    return;
+                if (!maybeCommand) {
+                    size_t take = (std::min)(m_input.size(), LASER_PRINTER_MOVE_BUFFER_LENGHT * 4 - m_batch.size());
+                    m_batch.insert(m_batch.end(), m_input.begin(), m_input.begin() + take);
+                    m_input.erase(m_input.begin(), m_input.begin() + take);
+                    if (m_batch.size() == LASER_PRINTER_MOVE_BUFFER_LENGHT * 4) {
+                        processBatch(now);
+                        m_batch.clear();
+                    }
+                    continue;
+                }
+            }
+            //Commands: split on '$', the last one is complete only once the line is silent
+            std::deque<char>::iterator next = std::find(m_input.begin() + 1, m_input.end(), '$');
+            if (next == m_input.end() && !gapElapsed)
+                return;
+            std::string command(m_input.begin(), next);
+            m_input.erase(m_input.begin(), next);
+            processCommand(command, now);
+        }
+    }
+
+    void processCommand(const std::string &command, Clock::time_point now) {
+        m_stats.commands++;
+        if (command.compare(0, 3, "$40") == 0) {
+            schedule(now + std::chrono::microseconds(m_timing.connectDelayUs), "connect");
+        }
+        else if (command.compare(0, 3, "$30") == 0) {
+            m_streaming = true;
+            m_stats.jobs++;
+            schedule(now + std::chrono::microseconds(m_timing.commandDelayUs), "ok");
+        }
+        else if (command.compare(0, 3, "$33") == 0) {
+            m_streaming = false;
+            Clock::time_point done = (std::max)(now, m_busyUntil) + std::chrono::microseconds(m_timing.finishDelayUs);
+            schedule(done, "F22");
+        }
+        else if (command.compare(0, 3, "$20") == 0 || command.compare(0, 3, "$25") == 0 || command.compare(0, 3, "$42") == 0) {
+            schedule(now + std::chrono::microseconds(m_timing.commandDelayUs), "ok");
+        }
+        //$8, $9, $10: settings, no answer
+    }
+
+    void processBatch(Clock::time_point now) {
+        if (m_inFlight >= m_timing.bufferDepth) {
+            m_stats.overflows++;
+            return;
+        }
+        m_inFlight++;
+        m_stats.maxInFlight = (std::max)(m_stats.maxInFlight, static_cast<size_t>(m_inFlight));
+        long long costUs = m_timing.batchBaseUs;
+        LaserPrinterMove move;
+        for (size_t i = 0; i < m_batch.size(); i += 4) {
+            move.fromCommand(&m_batch[i]);
+            if (move.duration != 0) {
+                m_stats.moves++;
+                costUs += static_cast<long long>(move.duration) * m_timing.burnUsPerUnit;
+            }
+        }
+        m_stats.batches++;
+        m_busyUntil = (std::max)(now, m_busyUntil) + std::chrono::microseconds(costUs);
+        schedule(m_busyUntil, "B1");
+    }
+
+    void schedule(Clock::time_point time, const std::string &message) {
+        if (m_timing.jitterUs > 0)
+            time += std::chrono::microseconds(std::uniform_int_distribution<int>(0, m_timing.jitterUs)(m_random));
+        //Replies leave in order, jitter can only delay the next ones
+        if (!m_replies.empty() && time < m_replies.back().time)
+            time = m_replies.back().time;
+        Reply reply;
+        reply.time = time;
+        reply.message = message;
+        m_replies.push_back(reply);
+    }
+
+    PrinterEmulatorTiming m_timing;
+    PrinterEmulatorStats m_stats;
+    std::mt19937 m_random;
+    bool m_streaming;
+    int m_inFlight;
+    std::deque<char> m_input;
+    std::vector<uint8_t> m_batch;
+    std::deque<Reply> m_replies;
+    Clock::time_point m_lastByteTime;
+    Clock::time_point m_busyUntil;
+
+    int m_master;
+    int m_slave;
+    std::string m_slavePath;
+    std::atomic<bool> m_running;
+    std::thread m_thread;
+};
+
+#endif // PrinterEmulator_hpp
@@ -0,0 +1,151 @@
+#ifndef ReceiveRing_hpp
+#define ReceiveRing_hpp
+
+#include <string>
+#include <chrono>
+#include <string.h>
+
+#define RECEIVE_RING_CAPACITY 4096 // power of 2
+
+/**
+* \brief Persistent receive buffer of a link, with an incremental token matcher.
+*   Bytes are read straight into the ring, a wait consumes exactly up to the end of the token it matched
+*   and keeps what follows for the next wait, so tokens split across two reads are found and nothing is allocated.
+*   When full, the oldest bytes are dropped.
+*/
+class ReceiveRing {
+public:
+    ReceiveRing()
+        : m_head(0)
+        , m_size(0)
+        , m_scanFrom(0)
+    {
+    }
+
+    size_t size() const {
+        return m_size;
+    }
+
+    char at(size_t index) const {
+        return m_data[(m_head + index) & (RECEIVE_RING_CAPACITY - 1)];
+    }
+
+    /**
+    * \brief Contiguous free space at the end of the ring, to read into before commitWrite().
+    */
+    char* writePointer(size_t &available) {
+        if (m_size == RECEIVE_RING_CAPACITY)
+            consume(RECEIVE_RING_CAPACITY / 2);
+        size_t tail = (m_head + m_size) & (RECEIVE_RING_CAPACITY - 1);
+        available = RECEIVE_RING_CAPACITY - m_size;
+        if (available > RECEIVE_RING_CAPACITY - tail)
+            available = RECEIVE_RING_CAPACITY - tail;
+        return &m_data[tail];
+    }
+
+    void commitWrite(size_t length) {
+        m_size += length;
+    }
+
+    void push(const char* data, size_t length) {
+        while (length > 0) {
+            size_t available;
+            char* destination = writePointer(available);
+            size_t chunk = length < available ? length : available;
+            memcpy(destination, data, chunk);
+            commitWrite(chunk);
+            data += chunk;
+            length -= chunk;
+        }
+    }
+
+    void consume(size_t length) {
+        if (length > m_size)
+            length = m_size;
+        m_head = (m_head + length) & (RECEIVE_RING_CAPACITY - 1);
+        m_size -= length;
+        m_scanFrom = m_scanFrom > length ? m_scanFrom - length : 0;
+    }
+
+    void clear() {
+        consume(m_size);
+    }
+
+    /**
+    * \brief Move every buffered byte to [out].
+    */
+    void take(std::string &out) {
+        out.clear();
+        out.reserve(m_size);
+        for (size_t i = 0; i < m_size; i++)
+            out += at(i);
+        clear();
+    }
+
+    /**
+    * \brief Look for the first occurrence of any of [tokens], only scanning positions not ruled out by a previous call.
+    *   An empty token matches any byte and consumes everything buffered.
+    * \return the index of the matched token, consumed along with everything before it. -1 if none.
+    */
+    int match(const char* const* tokens, size_t tokenCount) {
+        size_t maxLength = 0;
+        for (size_t t = 0; t < tokenCount; t++) {
+            size_t length = strlen(tokens[t]);
+            if (length == 0 && m_size > 0) {
+                clear();
+                return static_cast<int>(t);
+            }
+            if (length > maxLength)
+                maxLength = length;
+        }
+        for (size_t p = m_scanFrom; p < m_size; p++) {
+            for (size_t t = 0; t < tokenCount; t++) {
+                size_t length = strlen(tokens[t]);
+                if (length == 0 || p + length > m_size)
+                    continue;
+                size_t k = 0;
+                while (k < length && at(p + k) == tokens[t][k])
+                    k++;
+                if (k == length) {
+                    consume(p + length);
+                    m_scanFrom = 0;
+                    return static_cast<int>(t);
+                }
+            }
+        }
+        //Positions followed by at least maxLength bytes have been fully compared
+        if (maxLength > 0 && m_size >= maxLength)
+            m_scanFrom = m_size - maxLength + 1;
+        return -1;
+    }
+
+    /**
+    * \brief Wait until one of [tokens] is received or [timeoutMs] elapsed.
+    * \param fill: callable (char* buffer, size_t capacity, int timeoutMs) -> bytes read, blocking up to timeoutMs for the first byte.
+    * \return index of the matched token, -1 on timeout.
+    */
+    template <class Fill>
+    int waitFor(const char* const* tokens, size_t tokenCount, int timeoutMs, Fill fill) {
+        std::chrono::steady_clock::time_point deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(timeoutMs);
+        m_scanFrom = 0;
+        while (true) {
+            int matched = match(tokens, tokenCount);
+            if (matched >= 0)
+                return matched;
+            int remaining = static_cast<int>(std::chrono::duration_cast<std::chrono::milliseconds>(deadline - std::chrono::steady_clock::now()).count());
+            if (remaining <= 0)
+                return -1;
+            size_t available;
+            char* destination = writePointer(available);
+            commitWrite(fill(destination, available, remaining));
+        }
+    }
+
+private:
+    char m_data[RECEIVE_RING_CAPACITY];
+    size_t m_head;
+    size_t m_size;
+    size_t m_scanFrom;
+};
+
+#endif // ReceiveRing_hpp
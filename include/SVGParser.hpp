@@ -96,7 +96,7 @@ private:
             float y2 = pts[7];
             float distanceX = x2 - x1;
             float distanceY = y2 - y1;
-            float distance = std::sqrtf(std::powf(distanceX, 2.f) + std::powf(distanceY, 2.f));
+            float distance = std::sqrt(distanceX * distanceX + distanceY * distanceY);
             if (distance <= 3) {
                 segmentList.push_back(LaserPrinterSegment(x1, y1, x2, y2, 255));
             }
@@ -1,21 +1,54 @@
 #ifndef SERIALPORT_H
 #define SERIALPORT_H
 
-#define MAX_DATA_LENGTH 65535
-
-#include <windows.h>
+#ifdef _WIN32
+    #include <windows.h>
+    #include <thread>
+    #include <chrono>
+#else
+    #include <fcntl.h>
+    #include <termios.h>
+    #include <unistd.h>
+    #include <poll.h>
+    #include <dirent.h>
+    #include <errno.h>
+    #include <string.h>
+    #include <sys/ioctl.h>
+    #include <sys/uio.h>
+    #include <algorithm>
+#endif
 #include <stdio.h>
 #include <stdlib.h>
 #include <string>
 #include <vector>
 
+#include "ReceiveRing.hpp"
+
+#define SERIAL_PORT_MAX_IOV 16
+
+/**
+* \brief One piece of a gather write (see SerialPort::writev).
+*/
+struct SerialBuffer {
+    const void* data;
+    size_t length;
+};
+
+/**
+* \brief Serial link to the printer, configured in raw mode at 115200 8N1.
+*   Windows uses the Win32 COM API, other platforms use termios on a non-blocking file descriptor.
+*/
 class SerialPort
 {
 public:
+    /**
+    * \param portName: "COM5" on Windows, "ttyUSB0" or "/dev/ttyUSB0" on POSIX systems.
+    */
     inline SerialPort(std::string portName) {
+        this->connected = false;
+#ifdef _WIN32
         std::string port_str = "\\\\.\\";
         port_str += portName;
-        this->connected = false;
 
         this->handler = CreateFileA(static_cast<LPCSTR>(port_str.c_str()),
             GENERIC_READ | GENERIC_WRITE,
@@ -26,7 +59,7 @@ public:
             NULL);
         if (this->handler == INVALID_HANDLE_VALUE) {
             if (GetLastError() == ERROR_FILE_NOT_FOUND) {
-                printf("ERROR: Handle was not attached. Reason: %s not available\n", portName);
+                printf("ERROR: Handle was not attached. Reason: %s not available\n", portName.c_str());
             }
             else
             {
@@ -56,37 +89,189 @@ public:
                 }
             }
         }
+#else
+        std::string port_str = portName;
+        if (port_str.empty() || port_str[0] != '/')
+            port_str = "/dev/" + port_str;
+
+        this->handler = open(port_str.c_str(), O_RDWR | O_NOCTTY | O_NONBLOCK);
+        if (this->handler < 0) {
+            printf("ERROR: Handle was not attached. Reason: %s not available (%s)\n", portName.c_str(), strerror(errno));
+        }
+        else {
+            struct termios tty;
+            if (tcgetattr(this->handler, &tty) != 0) {
+                printf("failed to get current serial parameters\n");
+            }
+            else {
+                cfmakeraw(&tty);
+                cfsetispeed(&tty, B115200);
+                cfsetospeed(&tty, B115200);
+                tty.c_cflag &= ~(PARENB | CSTOPB | CSIZE | CRTSCTS);
+                tty.c_cflag |= CS8 | CLOCAL | CREAD;
+                tty.c_cc[VMIN] = 0;
+                tty.c_cc[VTIME] = 0;
+
+                if (tcsetattr(this->handler, TCSANOW, &tty) != 0) {
+                    printf("ALERT: could not set Serial port parameters\n");
+                }
+                else {
+                    int dtr = TIOCM_DTR;
+                    ioctl(this->handler, TIOCMBIS, &dtr);
+                    this->connected = true;
+                    tcflush(this->handler, TCIOFLUSH);
+                }
+            }
+            if (!this->connected) {
+                close(this->handler);
+                this->handler = -1;
+            }
+        }
+#endif
     }
 
     inline ~SerialPort() {
         if (this->connected) {
             this->connected = false;
+#ifdef _WIN32
             CloseHandle(this->handler);
+#else
+            close(this->handler);
+#endif
         }
     }
 
-    inline std::string read() {
+    /**
+    * \brief Return the bytes received so far.
+    * \param timeoutMs: time to wait for the first byte if nothing is pending yet. 0 returns immediately.
+    */
+    inline std::string read(int timeoutMs = 0) {
+        size_t available;
+        char* destination = this->ring.writePointer(available);
+        this->ring.commitWrite(receive(destination, available, this->ring.size() > 0 ? 0 : timeoutMs));
+        std::string out;
+        this->ring.take(out);
+        return out;
+    }
+
+    /**
+    * \brief Wait until one of [tokens] is received, without allocating.
+    *   The matched token and everything before it are consumed, the bytes after it are kept for the next call.
+    *   An empty token matches any data.
+    * \return the index of the matched token, -1 on timeout.
+    */
+    inline int waitFor(const char* const* tokens, size_t tokenCount, int timeoutMs) {
+        return this->ring.waitFor(tokens, tokenCount, timeoutMs, [this](char* buffer, size_t capacity, int timeout) {
+            return receive(buffer, capacity, timeout);
+        });
+    }
+
+    /**
+    * \brief Low level read of at most [capacity] bytes, bypassing the receive ring.
+    * \param timeoutMs: time to wait for the first byte. 0 returns immediately.
+    */
+    inline size_t receive(char* buffer, size_t capacity, int timeoutMs) {
+#ifdef _WIN32
         DWORD bytesRead;
         unsigned int toRead = 0;
+        std::chrono::steady_clock::time_point deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(timeoutMs);
         ClearCommError(this->handler, &this->errors, &this->status);
+        while (this->status.cbInQue == 0 && std::chrono::steady_clock::now() < deadline) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+            ClearCommError(this->handler, &this->errors, &this->status);
+        }
         if (this->status.cbInQue > 0) {
-            if (this->status.cbInQue > MAX_DATA_LENGTH)
-                toRead = MAX_DATA_LENGTH;
+            if (this->status.cbInQue > capacity)
+                toRead = capacity;
             else
                 toRead = this->status.cbInQue;
         }
-        if (toRead>0 && ReadFile(this->handler, this->inputBuffer, toRead, &bytesRead, NULL))
-            return std::string(this->inputBuffer, bytesRead);
-        return "";
+        if (toRead>0 && ReadFile(this->handler, buffer, toRead, &bytesRead, NULL))
+            return bytesRead;
+        return 0;
+#else
+        if (!this->connected || capacity == 0)
+            return 0;
+        struct pollfd pfd;
+        pfd.fd = this->handler;
+        pfd.events = POLLIN;
+        pfd.revents = 0;
+        int ready = poll(&pfd, 1, timeoutMs);
+        if (ready <= 0 || !(pfd.revents & POLLIN))
+            return 0;
+        ssize_t bytesRead = ::read(this->handler, buffer, capacity);
+        if (bytesRead > 0)
+            return bytesRead;
+        return 0;
+#endif
     }
 
-    inline bool write(std::string message) {
+    inline bool write(const std::string &message) {
+        return write(message.c_str(), message.length());
+    }
+
+    /**
+    * \brief Write [length] bytes straight from [data], blocks until everything is queued to the driver.
+    */
+    inline bool write(const void* data, size_t length) {
+        SerialBuffer buffer;
+        buffer.data = data;
+        buffer.length = length;
+        return writev(&buffer, 1);
+    }
+
+    /**
+    * \brief Gather write: send [count] buffers back to back without copying them together.
+    */
+    inline bool writev(const SerialBuffer* buffers, size_t count) {
+#ifdef _WIN32
         DWORD bytesSend;
-        if (!WriteFile(this->handler, (void*)message.c_str(), message.length(), &bytesSend, 0)) {
-            ClearCommError(this->handler, &this->errors, &this->status);
+        for (size_t i = 0; i < count; i++) {
+            if (!WriteFile(this->handler, buffers[i].data, buffers[i].length, &bytesSend, 0)) {
+                ClearCommError(this->handler, &this->errors, &this->status);
+                return false;
+            }
+        }
+        return true;
+#else
+        if (!this->connected)
             return false;
+        size_t index = 0;   // first buffer not fully sent
+        size_t offset = 0;  // bytes of buffers[index] already sent
+        while (index < count) {
+            struct iovec iov[SERIAL_PORT_MAX_IOV];
+            int iovCount = 0;
+            for (size_t i = index; i < count && iovCount < SERIAL_PORT_MAX_IOV; i++) {
+                size_t skip = (i == index) ? offset : 0;
+                iov[iovCount].iov_base = (char*)buffers[i].data + skip;
+                iov[iovCount].iov_len = buffers[i].length - skip;
+                iovCount++;
+            }
+            ssize_t n = ::writev(this->handler, iov, iovCount);
+            if (n >= 0) {
+                size_t sent = n;
+                while (index < count && sent >= buffers[index].length - offset) {
+                    sent -= buffers[index].length - offset;
+                    offset = 0;
+                    index++;
+                }
+                offset += sent;
+            }
+            else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                //Output queue full, wait for the line to drain
+                struct pollfd pfd;
+                pfd.fd = this->handler;
+                pfd.events = POLLOUT;
+                pfd.revents = 0;
+                if (poll(&pfd, 1, 1000) <= 0)
+                    return false;
+            }
+            else if (errno != EINTR) {
+                return false;
+            }
         }
-        else return true;
+        return true;
+#endif
     }
 
     inline bool isConnected() {
@@ -95,6 +280,7 @@ public:
 
     inline static std::vector<std::string> getSerialPortsList() {
         std::vector<std::string> serialList;
+#ifdef _WIN32
         TCHAR lpTargetPath[5000];
         DWORD test;
         for (int i = 0; i<255; i++) {
@@ -108,15 +294,31 @@ public:
                 continue;
             }
         }
+#else
+        DIR* dir = opendir("/dev");
+        if (dir == NULL)
+            return serialList;
+        for (struct dirent* entry = readdir(dir); entry != NULL; entry = readdir(dir)) {
+            std::string name = entry->d_name;
+            if (name.compare(0, 6, "ttyUSB") == 0 || name.compare(0, 6, "ttyACM") == 0)
+                serialList.push_back("/dev/" + name);
+        }
+        closedir(dir);
+        std::sort(serialList.begin(), serialList.end());
+#endif
         return serialList;
     }
 
 private:
+#ifdef _WIN32
     HANDLE handler;
-    bool connected;
     COMSTAT status;
     DWORD errors;
-    char inputBuffer[MAX_DATA_LENGTH];
+#else
+    int handler;
+#endif
+    bool connected;
+    ReceiveRing ring;
 };
 
-#endif // SERIALPORT_H
\ No newline at end of file
+#endif // SERIALPORT_H
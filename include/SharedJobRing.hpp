@@ -0,0 +1,435 @@
+#ifndef SharedJobRing_hpp
+#define SharedJobRing_hpp
+
+#ifndef _WIN32
+
+#include <string>
+#include <vector>
+#include <memory>
+#include <atomic>
+#include <new>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "LaserPrinter.hpp"
+
+#define SHARED_JOB_MAGIC 0x314A504Cu  // "LPJ1"
+#define SHARED_RING_MAGIC 0x3152504Cu // "LPR1"
+#define SHARED_JOB_NAME_LENGTH 64     // with the final 0, names start with '/'
+#define SHARED_JOB_DATA_ALIGNMENT 64
+#define SHARED_JOB_POLL_MS 10         // how often PrintDaemon polls the ring
+
+static_assert(ATOMIC_INT_LOCK_FREE == 2 && ATOMIC_LLONG_LOCK_FREE == 2, "shared memory needs address free atomics");
+
+enum SharedJobType {
+    SHARED_JOB_IMAGE = 0,   // width * height burn durations, as printImage() takes them
+    SHARED_JOB_PACKETS = 1  // 4 bytes print packets, printed as they are
+};
+
+enum SharedJobState {
+    SHARED_JOB_QUEUED = 0,
+    SHARED_JOB_PRINTING = 1,
+    SHARED_JOB_DONE = 2     // see result, the producer can unmap the job
+};
+
+/**
+* \brief First bytes of a job segment, the data follows at dataOffset.
+*   The producer fills the description before pushing the job on the ring, the printer process then only writes the status.
+*/
+struct SharedJobHeader {
+    uint32_t magic;
+    uint32_t type;          // SharedJobType
+    int32_t width;
+    int32_t height;
+    uint32_t fan;
+    uint32_t originX;
+    uint32_t originY;
+    uint32_t reserved;
+    uint64_t dataOffset;    // from the start of the segment
+    uint64_t dataLength;
+    std::atomic<uint32_t> cancelRequested;  // set by the producer
+    std::atomic<int32_t> state;             // SharedJobState
+    std::atomic<int32_t> result;            // 0 or a LaserPrinterError once done
+    std::atomic<uint64_t> movesSent;        // once done
+};
+
+/**
+* \brief Control segment: a single-producer/single-consumer ring of job segment names.
+*   head and tail only grow, each on its own cache line, a slot is free again once head passed it.
+*/
+struct SharedRingHeader {
+    uint32_t magic;
+    uint32_t capacity;      // power of 2
+    alignas(64) std::atomic<uint64_t> head;    // next slot to read, written by the printer process
+    alignas(64) std::atomic<uint64_t> tail;    // next slot to write, written by the producer
+};
+
+/**
+* \brief POSIX shared memory object mapped in this process, unmapped on destruction.
+*/
+class SharedMemoryRegion {
+public:
+    SharedMemoryRegion()
+        : m_data(NULL)
+        , m_size(0)
+    {
+    }
+
+    ~SharedMemoryRegion() {
+        if (m_data != NULL)
+            munmap(m_data, m_size);
+    }
+
+    /**
+    * \brief Create [name] with [size] zeroed bytes, replacing a stale object of the same name.
+    */
+    bool create(const std::string &name, size_t size) {
+        shm_unlink(name.c_str());
+        int fd = shm_open(name.c_str(), O_RDWR | O_CREAT | O_EXCL, 0600);
+        if (fd < 0)
+            return false;
+        bool ok = ftruncate(fd, size) == 0 && map(fd, size);
+        ::close(fd);
+        if (!ok)
+            shm_unlink(name.c_str());
+        return ok;
+    }
+
+    /**
+    * \brief Map the existing object [name] whole.
+    */
+    bool open(const std::string &name) {
+        int fd = shm_open(name.c_str(), O_RDWR, 0);
+        if (fd < 0)
+            return false;
+        struct stat info;
+        bool ok = fstat(fd, &info) == 0 && info.st_size > 0 && map(fd, info.st_size);
+        ::close(fd);
+        return ok;
+    }
+
+    uint8_t* data() {
+        return m_data;
+    }
+
+    size_t size() {
+        return m_size;
+    }
+
+    static void unlink(const std::string &name) {
+        shm_unlink(name.c_str());
+    }
+
+private:
+    SharedMemoryRegion(const SharedMemoryRegion&);
+    SharedMemoryRegion& operator=(const SharedMemoryRegion&);
+
+    bool map(int fd, size_t size) {
+        void* data = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        if (data == MAP_FAILED)
+            return false;
+        m_data = (uint8_t*)data;
+        m_size = size;
+        return true;
+    }
+
+    uint8_t* m_data;
+    size_t m_size;
+};
+
+/**
+* \brief The ring of job descriptors. The printer process creates it, the producer opens it.
+*   push() and pop() never block nor lock: one thread pushes, one thread pops.
+*/
+class SharedJobRing {
+public:
+    SharedJobRing()
+        : m_header(NULL)
+    {
+    }
+
+    bool create(const std::string &name, uint32_t capacity) {
+        if (capacity == 0 || (capacity & (capacity - 1)) != 0 || !m_region.create(name, sizeof(SharedRingHeader) + capacity * SHARED_JOB_NAME_LENGTH))
+            return false;
+        m_header = new (m_region.data()) SharedRingHeader();
+        m_header->capacity = capacity;
+        m_header->head = 0;
+        m_header->tail = 0;
+        std::atomic_thread_fence(std::memory_order_release);
+        m_header->magic = SHARED_RING_MAGIC;
+        return true;
+    }
+
+    bool open(const std::string &name) {
+        if (!m_region.open(name) || m_region.size() < sizeof(SharedRingHeader))
+            return false;
+        SharedRingHeader* header = (SharedRingHeader*)m_region.data();
+        if (header->magic != SHARED_RING_MAGIC || m_region.size() < sizeof(SharedRingHeader) + header->capacity * SHARED_JOB_NAME_LENGTH)
+            return false;
+        m_header = header;
+        return true;
+    }
+
+    bool isOpen() {
+        return m_header != NULL;
+    }
+
+    /**
+    * \brief Producer side: hand over the job segment [jobName].
+    * \return false if the ring is full or the name too long
+    */
+    bool push(const std::string &jobName) {
+        if (jobName.length() >= SHARED_JOB_NAME_LENGTH)
+            return false;
+        uint64_t tail = m_header->tail.load(std::memory_order_relaxed);
+        if (tail - m_header->head.load(std::memory_order_acquire) >= m_header->capacity)
+            return false;
+        char* slot = this->slot(tail);
+        memset(slot, 0, SHARED_JOB_NAME_LENGTH);
+        memcpy(slot, jobName.c_str(), jobName.length());
+        m_header->tail.store(tail + 1, std::memory_order_release);
+        return true;
+    }
+
+    /**
+    * \brief Printer side: take the next job segment name.
+    * \return false if the ring is empty
+    */
+    bool pop(std::string &jobName) {
+        uint64_t head = m_header->head.load(std::memory_order_relaxed);
+        if (head == m_header->tail.load(std::memory_order_acquire))
+            return false;
+        const char* slot = this->slot(head);
+        jobName.assign(slot, strnlen(slot, SHARED_JOB_NAME_LENGTH - 1));
+        m_header->head.store(head + 1, std::memory_order_release);
+        return true;
+    }
+
+private:
+    char* slot(uint64_t index) {
+        return (char*)m_region.data() + sizeof(SharedRingHeader) + (index & (m_header->capacity - 1)) * SHARED_JOB_NAME_LENGTH;
+    }
+
+    SharedMemoryRegion m_region;
+    SharedRingHeader* m_header;
+};
+
+/**
+* \brief Producer side job segment: render the job straight into data(), then push name() on the ring.
+*   The segment is unlinked on destruction: keep the SharedJob until isDone(), the printer process opens it when it pops the ring.
+*/
+class SharedJob {
+public:
+    SharedJob()
+        : m_header(NULL)
+    {
+    }
+
+    ~SharedJob() {
+        if (m_header != NULL)
+            SharedMemoryRegion::unlink(m_name);
+    }
+
+    /**
+    * \param dataLength: width * height for an image, 4 bytes per move for packets
+    */
+    bool create(const std::string &name, SharedJobType type, int width, int height, bool enableFan, unsigned int originX, unsigned int originY, size_t dataLength) {
+        size_t dataOffset = (sizeof(SharedJobHeader) + SHARED_JOB_DATA_ALIGNMENT - 1) / SHARED_JOB_DATA_ALIGNMENT * SHARED_JOB_DATA_ALIGNMENT;
+        if (!m_region.create(name, dataOffset + dataLength))
+            return false;
+        m_name = name;
+        m_header = new (m_region.data()) SharedJobHeader();
+        m_header->type = type;
+        m_header->width = width;
+        m_header->height = height;
+        m_header->fan = enableFan ? 1 : 0;
+        m_header->originX = originX;
+        m_header->originY = originY;
+        m_header->dataOffset = dataOffset;
+        m_header->dataLength = dataLength;
+        m_header->cancelRequested = 0;
+        m_header->state = SHARED_JOB_QUEUED;
+        m_header->result = LASER_PRINTER_OK;
+        m_header->movesSent = 0;
+        m_header->magic = SHARED_JOB_MAGIC;
+        return true;
+    }
+
+    const std::string& name() {
+        return m_name;
+    }
+
+    uint8_t* data() {
+        return m_region.data() + m_header->dataOffset;
+    }
+
+    SharedJobState state() {
+        return static_cast<SharedJobState>(m_header->state.load(std::memory_order_acquire));
+    }
+
+    bool isDone() {
+        return state() == SHARED_JOB_DONE;
+    }
+
+    /**
+    * \return 0 or a LaserPrinterError, once done
+    */
+    int result() {
+        return m_header->result;
+    }
+
+    size_t movesSent() {
+        return static_cast<size_t>(m_header->movesSent);
+    }
+
+    /**
+    * \brief Drop the job if it did not start yet, otherwise stop it like LaserPrinter::abort().
+    */
+    void cancel() {
+        m_header->cancelRequested = 1;
+    }
+
+private:
+    SharedMemoryRegion m_region;
+    SharedJobHeader* m_header;
+    std::string m_name;
+};
+
+/**
+* \brief Printer side: take the jobs pushed on a ring and queue them on the LaserPrinter worker thread without copying them,
+*   they are encoded straight from the producer's mapping. Job status and cancellation go through the job headers.
+*/
+class SharedJobReceiver {
+public:
+    /**
+    * \param ringName: shared memory object of the ring, created here, e.g. "/laserprinter"
+    */
+    SharedJobReceiver(LaserPrinter &printer, const std::string &ringName, uint32_t capacity = 64)
+        : m_printer(printer)
+        , m_ringName(ringName)
+    {
+        m_ring.create(ringName, capacity);
+    }
+
+    /**
+    * \brief The ring is removed, jobs not done are cancelled.
+    */
+    ~SharedJobReceiver() {
+        if (m_ring.isOpen())
+            SharedMemoryRegion::unlink(m_ringName);
+        for (size_t i = 0; i < m_jobs.size(); i++)
+            m_jobs[i].handle.cancel();
+        for (size_t i = 0; i < m_jobs.size(); i++)
+            m_jobs[i].handle.wait();
+        update();
+    }
+
+    bool isOpen() {
+        return m_ring.isOpen();
+    }
+
+    /**
+    * \brief Queue the jobs pushed since the last call, forward cancellations and publish the status of the finished jobs.
+    *   Never blocks, call it often (see PrintDaemon).
+    * \return the number of jobs queued
+    */
+    size_t poll() {
+        size_t queued = 0;
+        std::string jobName;
+        while (m_ring.pop(jobName))
+            queued += queue(jobName) ? 1 : 0;
+        update();
+        return queued;
+    }
+
+    /**
+    * \brief Jobs queued and not done yet.
+    */
+    size_t pendingCount() {
+        return m_jobs.size();
+    }
+
+private:
+    struct ReceivedJob {
+        std::shared_ptr<SharedMemoryRegion> region;
+        SharedJobHeader* header;
+        LaserPrintJob handle;
+    };
+
+    bool queue(const std::string &jobName) {
+        std::shared_ptr<SharedMemoryRegion> region = std::make_shared<SharedMemoryRegion>();
+        if (!region->open(jobName) || region->size() < sizeof(SharedJobHeader))
+            return false;
+        SharedJobHeader* header = (SharedJobHeader*)region->data();
+        if (header->magic != SHARED_JOB_MAGIC)
+            return false;
+        //The producer can still write the header: read it once, then only use the copies that were validated
+        uint32_t type = header->type;
+        uint64_t dataOffset = header->dataOffset;
+        uint64_t dataLength = header->dataLength;
+        int width = header->width;
+        int height = header->height;
+        bool enableFan = header->fan != 0;
+        unsigned int originX = header->originX;
+        unsigned int originY = header->originY;
+        bool valid = dataOffset <= region->size() && dataLength <= region->size() - dataOffset
+            && isInPrintArea(originX, originY, width, height);
+        if (type == SHARED_JOB_IMAGE)
+            valid = valid && width > 0 && height > 0 && dataLength >= static_cast<uint64_t>(width) * height;
+        else if (type == SHARED_JOB_PACKETS)
+            valid = valid && dataLength > 0 && dataLength % 4 == 0;
+        else
+            valid = false;
+        if (!valid) {
+            header->result = LASER_PRINTER_PLANNING_ERROR;
+            header->state.store(SHARED_JOB_DONE, std::memory_order_release);
+            return false;
+        }
+
+        const uint8_t* data = region->data() + dataOffset;
+        size_t packetCount = static_cast<size_t>(dataLength / 4);
+        LaserPrinter* printer = &m_printer;
+        std::function<void(BatchQueue&)> encode;
+        if (type == SHARED_JOB_IMAGE)
+            encode = [printer, data, width, height](BatchQueue &queue) { printer->encodeImage(data, width, height, queue); };
+        else
+            encode = [printer, data, packetCount](BatchQueue &queue) { printer->encodePackets(data, packetCount, queue); };
+        //The job holds the mapping: the producer may unlink the segment at any time
+        ReceivedJob job;
+        job.region = region;
+        job.header = header;
+        job.handle = m_printer.submit([printer, region, header, originX, originY, width, height, enableFan, encode]() {
+            header->state.store(SHARED_JOB_PRINTING, std::memory_order_release);
+            return printer->runJob(originX, originY, width, height, enableFan, NULL, encode);
+        });
+        m_jobs.push_back(job);
+        return true;
+    }
+
+    void update() {
+        for (size_t i = m_jobs.size(); i > 0; i--) {
+            ReceivedJob &job = m_jobs[i - 1];
+            if (job.header->cancelRequested)
+                job.handle.cancel();
+            if (!job.handle.isDone())
+                continue;
+            job.header->result = job.handle.wait();
+            job.header->movesSent = job.handle.movesSent();
+            job.header->state.store(SHARED_JOB_DONE, std::memory_order_release);
+            m_jobs.erase(m_jobs.begin() + (i - 1));
+        }
+    }
+
+    LaserPrinter &m_printer;
+    std::string m_ringName;
+    SharedJobRing m_ring;
+    std::vector<ReceivedJob> m_jobs;
+};
+
+#endif // _WIN32
+
+#endif // SharedJobRing_hpp
@@ -0,0 +1,356 @@
+#ifndef TrafficTrace_hpp
+#define TrafficTrace_hpp
+
+#include <string>
+#include <vector>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <chrono>
+#include <algorithm>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "LaserTransport.hpp"
+
+#define TRAFFIC_TRACE_MAGIC "LPTRACE1"
+#define TRAFFIC_TRACE_WRITE 0 // bytes written to the printer
+#define TRAFFIC_TRACE_READ 1  // bytes received from the printer
+
+/**
+* \brief One chunk of traffic: what a single write() sent, or what a single receive() got.
+*/
+struct TrafficRecord {
+    uint8_t direction;  // TRAFFIC_TRACE_WRITE or TRAFFIC_TRACE_READ
+    uint64_t timeUs;    // monotonic time since the start of the trace
+    std::string data;
+};
+
+/**
+* \brief Binary trace file: "LPTRACE1" then for each record its direction byte, the time since the previous record
+*   and the data length as LEB128 varints, and the data. A batch costs 4 bytes of framing, a "B1" 4 to 6.
+*/
+class TrafficTraceWriter {
+public:
+    TrafficTraceWriter(const std::string &filePath)
+        : m_file(fopen(filePath.c_str(), "wb"))
+        , m_start(std::chrono::steady_clock::now())
+        , m_lastUs(0)
+    {
+        if (m_file != NULL)
+            fwrite(TRAFFIC_TRACE_MAGIC, 1, 8, m_file);
+    }
+
+    ~TrafficTraceWriter() {
+        if (m_file != NULL)
+            fclose(m_file);
+    }
+
+    bool isOpen() {
+        return m_file != NULL;
+    }
+
+    /**
+    * \brief Append a record made of [count] buffers, timestamped now. Thread safe.
+    */
+    void record(uint8_t direction, const SerialBuffer* buffers, size_t count) {
+        uint64_t nowUs = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - m_start).count();
+        size_t length = 0;
+        for (size_t i = 0; i < count; i++)
+            length += buffers[i].length;
+        std::lock_guard<std::mutex> lock(m_mutex);
+        if (m_file == NULL)
+            return;
+        uint8_t header[1 + 10 + 10];
+        size_t headerLength = 0;
+        header[headerLength++] = direction;
+        headerLength += writeVarint(header + headerLength, nowUs > m_lastUs ? nowUs - m_lastUs : 0);
+        headerLength += writeVarint(header + headerLength, length);
+        m_lastUs = (std::max)(nowUs, m_lastUs);
+        fwrite(header, 1, headerLength, m_file);
+        for (size_t i = 0; i < count; i++)
+            fwrite(buffers[i].data, 1, buffers[i].length, m_file);
+    }
+
+    void record(uint8_t direction, const void* data, size_t length) {
+        SerialBuffer buffer;
+        buffer.data = data;
+        buffer.length = length;
+        record(direction, &buffer, 1);
+    }
+
+    void flush() {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        if (m_file != NULL)
+            fflush(m_file);
+    }
+
+private:
+    static size_t writeVarint(uint8_t* out, uint64_t value) {
+        size_t length = 0;
+        do {
+            uint8_t byte = value & 0x7F;
+            value >>= 7;
+            out[length++] = byte | (value != 0 ? 0x80 : 0);
+        } while (value != 0);
+        return length;
+    }
+
+    FILE* m_file;
+    std::mutex m_mutex;
+    std::chrono::steady_clock::time_point m_start;
+    uint64_t m_lastUs;
+};
+
+class TrafficTraceReader {
+public:
+    TrafficTraceReader(const std::string &filePath)
+        : m_file(fopen(filePath.c_str(), "rb"))
+        , m_timeUs(0)
+        , m_fileSize(0)
+    {
+        char magic[8];
+        if (m_file != NULL && fseek(m_file, 0, SEEK_END) == 0) {
+            long size = ftell(m_file);
+            m_fileSize = size > 0 ? static_cast<uint64_t>(size) : 0;
+            rewind(m_file);
+        }
+        if (m_file != NULL && (fread(magic, 1, 8, m_file) != 8 || memcmp(magic, TRAFFIC_TRACE_MAGIC, 8) != 0)) {
+            fclose(m_file);
+            m_file = NULL;
+        }
+    }
+
+    ~TrafficTraceReader() {
+        if (m_file != NULL)
+            fclose(m_file);
+    }
+
+    bool isOpen() {
+        return m_file != NULL;
+    }
+
+    /**
+    * \return false at the end of the trace, or on a truncated record: a length beyond the end of the file is
+    *   rejected before anything is allocated.
+    */
+    bool next(TrafficRecord &record) {
+        if (m_file == NULL)
+            return false;
+        int direction = fgetc(m_file);
+        uint64_t deltaUs;
+        uint64_t length;
+        if (direction == EOF || !readVarint(deltaUs) || !readVarint(length))
+            return false;
+        long position = ftell(m_file);
+        if (position < 0 || length > m_fileSize - (std::min)(m_fileSize, static_cast<uint64_t>(position)))
+            return false;
+        record.direction = static_cast<uint8_t>(direction);
+        m_timeUs += deltaUs;
+        record.timeUs = m_timeUs;
+        record.data.resize(static_cast<size_t>(length));
+        return length == 0 || fread(&record.data[0], 1, length, m_file) == length;
+    }
+
+    /**
+    * \brief Every record of [filePath], empty if it is not a trace.
+    */
+    static std::vector<TrafficRecord> load(const std::string &filePath) {
+        std::vector<TrafficRecord> records;
+        TrafficTraceReader reader(filePath);
+        TrafficRecord record;
+        while (reader.next(record))
+            records.push_back(record);
+        return records;
+    }
+
+private:
+    bool readVarint(uint64_t &value) {
+        value = 0;
+        for (int shift = 0; shift < 64; shift += 7) {
+            int byte = fgetc(m_file);
+            if (byte == EOF)
+                return false;
+            value |= static_cast<uint64_t>(byte & 0x7F) << shift;
+            if (!(byte & 0x80))
+                return true;
+        }
+        return false;
+    }
+
+    FILE* m_file;
+    uint64_t m_timeUs;
+    uint64_t m_fileSize;
+};
+
+/**
+* \brief Record every byte written to and received from another transport into a trace file.
+*   Takes ownership of the wrapped transport.
+*/
+class TraceTransport : public LaserTransport {
+public:
+    TraceTransport(LaserTransport* transport, const std::string &filePath)
+        : m_transport(transport)
+        , m_trace(filePath)
+    {
+    }
+
+    ~TraceTransport() {
+        delete m_transport;
+    }
+
+    bool isOpen() {
+        return m_transport->isOpen() && m_trace.isOpen();
+    }
+
+    using LaserTransport::write;
+
+    bool write(const void* data, size_t length) {
+        m_trace.record(TRAFFIC_TRACE_WRITE, data, length);
+        return m_transport->write(data, length);
+    }
+
+    bool writev(const SerialBuffer* buffers, size_t count) {
+        m_trace.record(TRAFFIC_TRACE_WRITE, buffers, count);
+        return m_transport->writev(buffers, count);
+    }
+
+    /**
+    * \brief Receives through the wrapped transport's receive(), its own token matching is bypassed so every byte is seen here.
+    */
+    size_t receive(char* buffer, size_t capacity, int timeoutMs) {
+        size_t length = m_transport->receive(buffer, capacity, timeoutMs);
+        if (length > 0)
+            m_trace.record(TRAFFIC_TRACE_READ, buffer, length);
+        return length;
+    }
+
+    std::string name() {
+        return m_transport->name();
+    }
+
+    bool isHardware() {
+        return m_transport->isHardware();
+    }
+
+private:
+    LaserTransport* m_transport;
+    TrafficTraceWriter m_trace;
+};
+
+/**
+* \brief Fake printer replaying the replies of a trace.
+*   A recorded reply is scheduled after the write that preceded it in the trace, and after the previous reply,
+*   with the recorded delay divided by [speed]: the firmware timing is reproduced whatever the driver does.
+*   Writes are compared to the recorded ones, see mismatchCount().
+*/
+class ReplayTransport : public LaserTransport {
+public:
+    /**
+    * \param speed: 1 for the original timing, 2 for twice as fast... 0 delivers every reply as soon as it is due.
+    */
+    ReplayTransport(const std::string &filePath, double speed = 1.0)
+        : m_filePath(filePath)
+        , m_speed(speed)
+        , m_writeCount(0)
+        , m_mismatches(0)
+        , m_lastReply(std::chrono::steady_clock::now())
+    {
+        m_writeTimes.push_back(m_lastReply);
+        std::vector<TrafficRecord> records = TrafficTraceReader::load(filePath);
+        uint64_t lastWriteUs = 0;
+        uint64_t lastReplyUs = 0;
+        for (size_t i = 0; i < records.size(); i++) {
+            if (records[i].direction == TRAFFIC_TRACE_WRITE) {
+                m_expectedWrites.push_back(records[i].data);
+                lastWriteUs = records[i].timeUs;
+            }
+            else {
+                ReplayReply reply;
+                reply.afterWrite = m_expectedWrites.size();
+                uint64_t anchorUs = (std::max)(lastWriteUs, lastReplyUs);
+                reply.delayUs = records[i].timeUs - anchorUs;
+                reply.data = records[i].data;
+                m_replies.push_back(reply);
+                lastReplyUs = records[i].timeUs;
+            }
+        }
+    }
+
+    bool isOpen() {
+        return !m_expectedWrites.empty() || !m_replies.empty();
+    }
+
+    using LaserTransport::write;
+
+    bool write(const void* data, size_t length) {
+        if (m_writeCount >= m_expectedWrites.size() || m_expectedWrites[m_writeCount].compare(0, std::string::npos, (const char*)data, length) != 0)
+            m_mismatches++;
+        m_writeCount++;
+        m_writeTimes.push_back(std::chrono::steady_clock::now());
+        return true;
+    }
+
+    size_t receive(char* buffer, size_t capacity, int timeoutMs) {
+        std::chrono::steady_clock::time_point deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(timeoutMs);
+        //The driver writes from this thread too: a reply waiting for a write can not come during this call
+        if (m_replies.empty() || m_replies.front().afterWrite > m_writeCount) {
+            std::this_thread::sleep_until(deadline);
+            return 0;
+        }
+        ReplayReply &reply = m_replies.front();
+        std::chrono::steady_clock::time_point due = (std::max)(m_writeTimes[reply.afterWrite], m_lastReply);
+        if (m_speed > 0)
+            due += std::chrono::microseconds(static_cast<long long>(reply.delayUs / m_speed));
+        if (due > deadline) {
+            std::this_thread::sleep_until(deadline);
+            return 0;
+        }
+        std::this_thread::sleep_until(due);
+        m_lastReply = due;
+        size_t length = (std::min)(capacity, reply.data.length());
+        memcpy(buffer, reply.data.c_str(), length);
+        reply.data.erase(0, length);
+        reply.delayUs = 0;
+        if (reply.data.empty())
+            m_replies.pop_front();
+        return length;
+    }
+
+    std::string name() {
+        return m_filePath;
+    }
+
+    /**
+    * \brief Writes that differ from the trace: the driver did not send what was recorded.
+    */
+    size_t mismatchCount() {
+        return m_mismatches;
+    }
+
+    /**
+    * \brief Recorded replies not delivered yet.
+    */
+    size_t remainingReplies() {
+        return m_replies.size();
+    }
+
+private:
+    struct ReplayReply {
+        size_t afterWrite;  // writes the driver must have made before the reply
+        uint64_t delayUs;   // after that write and the previous reply
+        std::string data;
+    };
+
+    std::string m_filePath;
+    double m_speed;
+    std::vector<std::string> m_expectedWrites;
+    std::deque<ReplayReply> m_replies;
+    size_t m_writeCount;
+    size_t m_mismatches;
+    std::vector<std::chrono::steady_clock::time_point> m_writeTimes;  // [0] is the opening, [n] the n-th write
+    std::chrono::steady_clock::time_point m_lastReply;
+};
+
+#endif // TrafficTrace_hpp
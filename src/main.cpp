@@ -6,12 +6,25 @@
 
 #include "LaserPrinter.hpp"
 #include "SVGParser.hpp"
+#ifndef _WIN32
+    #include <signal.h>
+    #include "PrintDaemon.hpp"
+#endif
 
 void printSVGFile(LaserPrinter &printer, std::string filePath);
 void printSquareInCircle(LaserPrinter &printer);
 void printImage(LaserPrinter &printer);
+int runDaemon(int argc, char **argv);
+int runCompile(int argc, char **argv);
+int runPrintFile(int argc, char **argv);
 
 int main(int argc, char **argv) {
+    if (argc > 1 && std::string(argv[1]) == "--daemon")
+        return runDaemon(argc, argv);
+    if (argc > 1 && std::string(argv[1]) == "--compile")
+        return runCompile(argc, argv);
+    if (argc > 1 && std::string(argv[1]) == "--print")
+        return runPrintFile(argc, argv);
 
     bool simulation = false; //Will print in an OpenCV windows instead of using the printer
     LaserPrinter printer("COM5", simulation); //If the simulation is used, no connection will be established
@@ -44,7 +57,7 @@ void printSVGFile(LaserPrinter &printer, std::string filePath) {
 
     std::cout << "startAreaPreview for 5 seconds" << std::endl;
     printer.startAreaPreview(width, height);
-    Sleep(5000);
+    std::this_thread::sleep_for(std::chrono::milliseconds(5000));
 
     std::cout << "stopAreaPreview" << std::endl;
     printer.stopAreaPreview();
@@ -93,7 +106,7 @@ void printSquareInCircle(LaserPrinter &printer) {
 
     std::cout << "startAreaPreview for 5 seconds" << std::endl;
     printer.startAreaPreview(radius * 2, radius * 2);
-    Sleep(5000);
+    std::this_thread::sleep_for(std::chrono::milliseconds(5000));
 
     std::cout << "stopAreaPreview" << std::endl;
     printer.stopAreaPreview();
@@ -128,7 +141,7 @@ void printImage(LaserPrinter &printer) {
 
     std::cout << "startAreaPreview for 5 seconds" << std::endl;
     printer.startAreaPreview(width, height);
-    Sleep(5000);
+    std::this_thread::sleep_for(std::chrono::milliseconds(5000));
 
     std::cout << "stopAreaPreview" << std::endl;
     printer.stopAreaPreview();
@@ -144,3 +157,130 @@ void printImage(LaserPrinter &printer) {
         std::cout << "The image is out of the printing area. The maximium size should be 1024*1024." << std::endl;
     }
 }
+
+/**
+* \brief Read the whole of [text] as a number between [min] and [max].
+*/
+static bool parseArgument(const char* text, double min, double max, double &value) {
+    char* end = NULL;
+    value = strtod(text, &end);
+    return end != text && *end == '\0' && value >= min && value <= max;
+}
+
+/**
+* \brief LaserPrinterSVG --compile <file.svg> <file.lpm> [originX originY [power depth [fan 0|1]]]:
+*   plan and encode an SVG file once, see PrintProgramFile.hpp. No printer needed.
+*/
+int runCompile(int argc, char **argv) {
+    std::string usage = "Usage: --compile <file.svg> <file.lpm> [originX originY [power depth [fan 0|1]]]\n"
+        "  originX 0 to " + std::to_string(LASER_PRINTER_RESOLUTION_WIDTH) + ", originY 0 to " + std::to_string(LASER_PRINTER_RESOLUTION_HEIGHT)
+        + ", power and depth 0 to 1";
+    if (argc < 4) {
+        std::cout << usage << std::endl;
+        return 1;
+    }
+    PrintProgramSettings settings;
+    double originX = 0;
+    double originY = 0;
+    double power = -1;
+    double depth = -1;
+    double fan = 0;
+    bool valid = true;
+    if (argc > 5) {
+        valid = parseArgument(argv[4], 0, LASER_PRINTER_RESOLUTION_WIDTH, originX)
+            && parseArgument(argv[5], 0, LASER_PRINTER_RESOLUTION_HEIGHT, originY);
+    }
+    if (argc > 7) {
+        valid = valid && parseArgument(argv[6], 0, 1, power)
+            && parseArgument(argv[7], 0, 1, depth);
+    }
+    if (argc > 8)
+        valid = valid && parseArgument(argv[8], 0, 1, fan) && (fan == 0 || fan == 1);
+    if (!valid) {
+        std::cout << usage << std::endl;
+        return 1;
+    }
+    settings.originX = static_cast<unsigned int>(originX);
+    settings.originY = static_cast<unsigned int>(originY);
+    settings.power = static_cast<float>(power);
+    settings.depth = static_cast<float>(depth);
+    settings.fan = fan == 1;
+    int width, height;
+    std::vector<LaserPrinterSegment> segments = SVGParser::getSegments(argv[2], width, height);
+    if (segments.empty())
+        return 1;
+    std::shared_ptr<const PrintProgram> program = LaserPrinter::compileShape(segments, width, height);
+    if (!PrintProgramFile::save(argv[3], *program, settings)) {
+        std::cout << "Could not write " << argv[3] << std::endl;
+        return 1;
+    }
+    std::cout << argv[3] << ": " << program->batchCount() << " batches, " << program->moveCount() << " moves" << std::endl;
+    return 0;
+}
+
+/**
+* \brief LaserPrinterSVG --print <file.lpm> [serial port]: print a compiled job file.
+*/
+int runPrintFile(int argc, char **argv) {
+    if (argc < 3) {
+        std::cout << "Usage: --print <file.lpm> [serial port]" << std::endl;
+        return 1;
+    }
+    LaserPrinter printer(argc > 3 ? argv[3] : "auto");
+    if (!printer.isConnected()) {
+        std::cout << "Laser printer not found" << std::endl;
+        return 1;
+    }
+    int result = printer.printProgramFile(argv[2]);
+    if (result != LASER_PRINTER_OK)
+        std::cout << "Print failed: " << printer.getLastErrorMessage() << std::endl;
+    return result == LASER_PRINTER_OK ? 0 : 1;
+}
+
+#ifndef _WIN32
+static PrintDaemon* s_daemon = NULL;
+
+static void onSignal(int) {
+    if (s_daemon != NULL)
+        s_daemon->stop();
+}
+
+/**
+* \brief LaserPrinterSVG --daemon [socket path] [serial port] [shared memory ring]: keep the printer connected and take jobs
+*   on a Unix socket, see PrintDaemon.hpp, and on a shared memory ring if named (e.g. /laserprinter), see SharedJobRing.hpp.
+*/
+int runDaemon(int argc, char **argv) {
+    std::string socketPath = argc > 2 ? argv[2] : "/tmp/laserprinter.sock";
+    std::string serialPort = argc > 3 ? argv[3] : "auto";
+    LaserPrinter printer(serialPort);
+    if (!printer.isConnected()) {
+        std::cout << "Laser printer not found" << std::endl;
+        return 1;
+    }
+    PrintDaemon daemon(printer, socketPath);
+    if (!daemon.listen())
+        return 1;
+    std::unique_ptr<SharedJobReceiver> sharedJobs;
+    if (argc > 4) {
+        sharedJobs.reset(new SharedJobReceiver(printer, argv[4]));
+        if (!sharedJobs->isOpen()) {
+            std::cout << "Could not create the shared memory ring " << argv[4] << std::endl;
+            return 1;
+        }
+        daemon.setSharedJobs(sharedJobs.get());
+        std::cout << "Shared memory jobs on " << argv[4] << std::endl;
+    }
+    std::cout << "Printer on " << printer.getPortName() << ", jobs on " << socketPath << std::endl;
+    s_daemon = &daemon;
+    signal(SIGINT, onSignal);
+    signal(SIGTERM, onSignal);
+    daemon.serve();
+    s_daemon = NULL;
+    return 0;
+}
+#else
+int runDaemon(int argc, char **argv) {
+    std::cout << "The print daemon needs Unix sockets" << std::endl;
+    return 1;
+}
+#endif
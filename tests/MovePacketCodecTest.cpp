@@ -0,0 +1,39 @@
+#include <stdio.h>
+#include <vector>
+
+#include "MovePacketCodec.hpp"
+
+/**
+* Exhaustive check of MovePacketCodec against LaserPrinterMove::toCommand() and fromCommand():
+*   every x and y of the 12 bits range, a row of 4096 moves at a time, with every duration.
+*   Returns 0 when both agree everywhere.
+*/
+int main() {
+    const size_t count = 4096;
+    std::vector<uint16_t> x(count), y(count), decodedX(count), decodedY(count);
+    std::vector<uint8_t> duration(count), decodedDuration(count), packets(count * 4);
+    size_t errors = 0;
+    for (unsigned int row = 0; row < 4096; row++) {
+        for (size_t i = 0; i < count; i++) {
+            x[i] = static_cast<uint16_t>(i);
+            y[i] = static_cast<uint16_t>(row);
+            duration[i] = static_cast<uint8_t>(i + row);
+        }
+        MovePacketCodec::encode(&x[0], &y[0], &duration[0], count, &packets[0]);
+        MovePacketCodec::decode(&packets[0], count, &decodedX[0], &decodedY[0], &decodedDuration[0]);
+        for (size_t i = 0; i < count; i++) {
+            uint8_t expected[4];
+            LaserPrinterMove(x[i], y[i], duration[i]).toCommand(expected);
+            LaserPrinterMove move;
+            move.fromCommand(&packets[i * 4]);
+            bool encoded = expected[0] == packets[i * 4] && expected[1] == packets[i * 4 + 1]
+                && expected[2] == packets[i * 4 + 2] && expected[3] == packets[i * 4 + 3];
+            bool decoded = decodedX[i] == move.x && decodedY[i] == move.y && decodedDuration[i] == move.duration
+                && move.x == x[i] && move.y == y[i] && move.duration == duration[i];
+            if ((!encoded || !decoded) && errors++ < 10)
+                printf("Mismatch at x %u y %u duration %u: %s\n", (unsigned int)x[i], (unsigned int)y[i], (unsigned int)duration[i], encoded ? "decode" : "encode");
+        }
+    }
+    printf("%zu mismatches in %u moves\n", errors, 4096u * 4096u);
+    return errors == 0 ? 0 : 1;
+}
@@ -0,0 +1,146 @@
+#include <iostream>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+
+#include "LaserPrinter.hpp"
+#include "PrinterEmulator.hpp"
+#include "TrafficTrace.hpp"
+
+/**
+* Firmware emulator on a pseudo-terminal.
+*   LaserPrinterEmulator [options]          serve until Ctrl-C, point LaserPrinter at the printed device path
+*   LaserPrinterEmulator [options] --bench  drive it with LaserPrinter and report the moves/second
+* Options (microseconds): --batch-us N --burn-us N --jitter-us N --connect-us N --command-us N --finish-us N
+*   --depth N: batches the emulated firmware buffers (default 1)
+*   --moves N: number of moves of the benchmark job (default 100000)
+*   --window N: batch window used by the benchmark, 0 probes it (default 1)
+*   --retries N: resend unacknowledged batches up to N times instead of aborting (default 0)
+*   --link-test N: run LaserPrinter::runLinkTest with N batches before the benchmark (default 0, skipped)
+*   --trace FILE: record the benchmark traffic to FILE
+*   --replay FILE: run the benchmark against the replies recorded in FILE instead of the emulator, same options as the recording
+*   --speed X: replay speed factor, 0 for no delay (default 1)
+*/
+
+static volatile sig_atomic_t s_stop = 0;
+
+static void onSignal(int) {
+    s_stop = 1;
+}
+
+/**
+* \param replay: [transport] when replaying a trace, to report how faithful the replay was.
+*/
+static int runBenchmark(LaserTransport* transport, int moveCount, int window, int retries, int linkTestBatches, ReplayTransport* replay = NULL) {
+    LaserPrinter printer(transport);
+    if (!printer.isConnected()) {
+        std::cout << "The printer did not answer the handshake" << std::endl;
+        return 1;
+    }
+    if (linkTestBatches > 0) {
+        LaserLinkReport report = printer.runLinkTest(linkTestBatches);
+        std::cout << "Link test: " << report.batches << " batches, " << report.failures << " failures, "
+            << report.batchesPerSecond << " batches/s, " << report.movesPerSecond << " moves/s, ack p50 "
+            << report.p50AckMs << " ms, p99 " << report.p99AckMs << " ms, max " << report.maxAckMs << " ms" << std::endl;
+    }
+    if (window > 0)
+        printer.setBatchWindow(window);
+    else
+        std::cout << "Probed batch window: " << printer.probeBatchWindow(8, 1000, true) << std::endl; //the emulator is on the serial port
+    if (retries > 0)
+        printer.setRecoveryPolicy(LASER_PRINTER_RECOVERY_RESEND, retries);
+    //Vertical lines, one move per pixel
+    std::vector<LaserPrinterSegment> segments;
+    int moves = 0;
+    for (int x = 0; moves < moveCount; x = (x + 1) % 1000) {
+        segments.push_back(LaserPrinterSegment(x, 0, x, 999, 1));
+        moves += 1000;
+    }
+    printer.setPrintOrigin(0, 0);
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    int result = printer.printShape(segments, 1000, 1000, false);
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    std::cout << "printShape returned " << result << " after " << seconds << " s: "
+        << moves / seconds << " moves/s, " << (moves / 256.0) / seconds << " batches/s" << std::endl;
+    if (result != 0)
+        std::cout << "Error: " << printer.getLastErrorMessage() << std::endl;
+    if (replay != NULL)
+        std::cout << "Replay: " << replay->mismatchCount() << " writes differ from the trace, "
+            << replay->remainingReplies() << " replies not delivered" << std::endl;
+    return result == 0 ? 0 : 1;
+}
+
+int main(int argc, char **argv) {
+    PrinterEmulatorTiming timing;
+    bool bench = false;
+    int moveCount = 100000;
+    int window = 1;
+    int retries = 0;
+    int linkTestBatches = 0;
+    std::string tracePath;
+    std::string replayPath;
+    double speed = 1.0;
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        int value = i + 1 < argc ? atoi(argv[i + 1]) : 0;
+        if (arg == "--bench") { bench = true; continue; }
+        std::string text = i + 1 < argc ? argv[i + 1] : "";
+        if (arg == "--batch-us") timing.batchBaseUs = value;
+        else if (arg == "--burn-us") timing.burnUsPerUnit = value;
+        else if (arg == "--jitter-us") timing.jitterUs = value;
+        else if (arg == "--connect-us") timing.connectDelayUs = value;
+        else if (arg == "--command-us") timing.commandDelayUs = value;
+        else if (arg == "--finish-us") timing.finishDelayUs = value;
+        else if (arg == "--depth") timing.bufferDepth = value;
+        else if (arg == "--moves") moveCount = value;
+        else if (arg == "--window") window = value;
+        else if (arg == "--retries") retries = value;
+        else if (arg == "--link-test") linkTestBatches = value;
+        else if (arg == "--trace") tracePath = text;
+        else if (arg == "--replay") replayPath = text;
+        else if (arg == "--speed") speed = atof(text.c_str());
+        else {
+            std::cout << "Unknown option " << arg << std::endl;
+            return 1;
+        }
+        i++;
+    }
+
+    if (!replayPath.empty()) {
+        ReplayTransport* replay = new ReplayTransport(replayPath, speed);
+        if (!replay->isOpen()) {
+            std::cout << "Could not read the trace " << replayPath << std::endl;
+            delete replay;
+            return 1;
+        }
+        return runBenchmark(replay, moveCount, window, retries, linkTestBatches, replay);
+    }
+
+    PrinterEmulator emulator(timing);
+    std::string devicePath = emulator.start();
+    if (devicePath.empty()) {
+        std::cout << "Could not open a pseudo-terminal" << std::endl;
+        return 1;
+    }
+    int result = 0;
+    if (bench) {
+        LaserTransport* transport = new SerialTransport(devicePath);
+        if (!tracePath.empty())
+            transport = new TraceTransport(transport, tracePath);
+        result = runBenchmark(transport, moveCount, window, retries, linkTestBatches);
+    }
+    else {
+        std::cout << "Emulated printer on " << devicePath << " (Ctrl-C to stop)" << std::endl;
+        signal(SIGINT, onSignal);
+        signal(SIGTERM, onSignal);
+        while (!s_stop)
+            std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    }
+    emulator.stop();
+    PrinterEmulatorStats stats = emulator.stats();
+    std::cout << "Received " << stats.commands << " commands, " << stats.jobs << " jobs, "
+        << stats.batches << " batches, " << stats.moves << " moves, "
+        << stats.overflows << " overflows, " << stats.maxInFlight << " batches buffered at most" << std::endl;
+    return result;
+}